@@ -0,0 +1,215 @@
+//
+// Created by aucker on 10/17/2026.
+//
+
+/*
+ * Compares the string hash in src/hash.c with the FNV-1a clox used before
+ * it: how many 32-bit collisions each has on a few sets of keys, and how
+ * fast each goes over strings of various lengths. Source files passed as
+ * arguments, like those under src/ and include/, add the identifiers in
+ * them as another key set.
+ */
+
+// For clock_gettime(), which isn't in C99.
+#define _DEFAULT_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "hash.h"
+
+typedef uint32_t (*HashFn)(const char* key, int length);
+
+typedef struct {
+    char** keys;
+    int* lengths;
+    int count;
+    int capacity;
+} KeySet;
+
+static uint32_t fnv1a(const char* key, int length) {
+    uint32_t hash = 2166136261u;
+    for (int i = 0; i < length; i++) {
+        hash ^= (uint8_t)key[i];
+        hash *= 16777619;
+    }
+    return hash;
+}
+
+static double now() {
+    struct timespec time;
+    clock_gettime(CLOCK_MONOTONIC, &time);
+    return (double)time.tv_sec + (double)time.tv_nsec / 1e9;
+}
+
+static void addKey(KeySet* set, const char* chars, int length) {
+    if (set->count == set->capacity) {
+        set->capacity = set->capacity < 8 ? 8 : set->capacity * 2;
+        set->keys = realloc(set->keys, sizeof(char*) * set->capacity);
+        set->lengths = realloc(set->lengths, sizeof(int) * set->capacity);
+    }
+    char* key = malloc(length + 1);
+    memcpy(key, chars, length);
+    key[length] = '\0';
+    set->keys[set->count] = key;
+    set->lengths[set->count] = length;
+    set->count++;
+}
+
+static void freeKeys(KeySet* set) {
+    for (int i = 0; i < set->count; i++) free(set->keys[i]);
+    free(set->keys);
+    free(set->lengths);
+    set->keys = NULL;
+    set->lengths = NULL;
+    set->count = set->capacity = 0;
+}
+
+static int compareKeys(const void* a, const void* b) {
+    const char* left = *(const char* const*)a;
+    const char* right = *(const char* const*)b;
+    return strcmp(left, right);
+}
+
+static int compareHashes(const void* a, const void* b) {
+    uint32_t left = *(const uint32_t*)a;
+    uint32_t right = *(const uint32_t*)b;
+    return left < right ? -1 : left > right;
+}
+
+// Every distinct identifier-like word in the files.
+static void readIdentifiers(KeySet* set, int fileCount, char** files) {
+    KeySet words = {NULL, NULL, 0, 0};
+    for (int i = 0; i < fileCount; i++) {
+        FILE* file = fopen(files[i], "r");
+        if (file == NULL) {
+            fprintf(stderr, "Could not open file \"%s\".\n", files[i]);
+            exit(74);
+        }
+
+        char word[256];
+        int length = 0;
+        int c;
+        while ((c = fgetc(file)) != EOF) {
+            if (c == '_' || (c >= 'a' && c <= 'z') ||
+                (c >= 'A' && c <= 'Z') || (c >= '0' && c <= '9')) {
+                if (length < (int)sizeof(word)) word[length++] = (char)c;
+            } else if (length > 0) {
+                addKey(&words, word, length);
+                length = 0;
+            }
+        }
+        if (length > 0) addKey(&words, word, length);
+        fclose(file);
+    }
+
+    qsort(words.keys, words.count, sizeof(char*), compareKeys);
+    for (int i = 0; i < words.count; i++) {
+        if (i > 0 && strcmp(words.keys[i], words.keys[i - 1]) == 0) continue;
+        addKey(set, words.keys[i], (int)strlen(words.keys[i]));
+    }
+    freeKeys(&words);
+}
+
+// Keys that differ from the one before in one of the same few bytes.
+static void binaryStrings(KeySet* set) {
+    char key[20];
+    for (int i = 0; i < (1 << 20); i++) {
+        for (int bit = 0; bit < 20; bit++) {
+            key[bit] = (i >> (19 - bit)) & 1 ? 'b' : 'a';
+        }
+        addKey(set, key, 20);
+    }
+}
+
+static void decimals(KeySet* set) {
+    char key[16];
+    for (int i = 0; i < 1000000; i++) {
+        addKey(set, key, sprintf(key, "%d", i));
+    }
+}
+
+static void strideKeys(KeySet* set) {
+    char key[32];
+    for (int i = 0; i < 1000000; i++) {
+        addKey(set, key, sprintf(key, "key%ld", (long)i * 4096));
+    }
+}
+
+static int countCollisions(KeySet* set, HashFn hash) {
+    uint32_t* hashes = malloc(sizeof(uint32_t) * set->count);
+    for (int i = 0; i < set->count; i++) {
+        hashes[i] = hash(set->keys[i], set->lengths[i]);
+    }
+    qsort(hashes, set->count, sizeof(uint32_t), compareHashes);
+
+    int collisions = 0;
+    for (int i = 1; i < set->count; i++) {
+        if (hashes[i] == hashes[i - 1]) collisions++;
+    }
+    free(hashes);
+    return collisions;
+}
+
+static void reportCollisions(const char* name, KeySet* set) {
+    // What a random 32-bit function would be expected to give.
+    double expected = (double)set->count * (set->count - 1) / 2 / 4294967296.0;
+    printf("%-30s %8d keys %8d %8d %10.1f\n", name, set->count,
+           countCollisions(set, fnv1a), countCollisions(set, hashString),
+           expected);
+}
+
+static double throughput(HashFn hash, const char* data, int length) {
+    // About 256 MB of hashing, whatever the length.
+    long iterations = (256L << 20) / length;
+    if (iterations > 20000000) iterations = 20000000;
+
+    volatile uint32_t sink = 0;
+    double start = now();
+    for (long i = 0; i < iterations; i++) {
+        // Different offsets, so no call can reuse the last one's result.
+        sink += hash(data + (i & 63), length);
+    }
+    double seconds = now() - start;
+    (void)sink;
+    return (double)length * iterations / seconds / 1e6;
+}
+
+int main(int argc, char* argv[]) {
+    KeySet set = {NULL, NULL, 0, 0};
+
+    printf("32-bit collisions %29s %8s %8s %10s\n", "", "fnv1a", "wyhash",
+           "random");
+    if (argc > 1) {
+        readIdentifiers(&set, argc - 1, argv + 1);
+        reportCollisions("identifiers in the sources", &set);
+        freeKeys(&set);
+    }
+    binaryStrings(&set);
+    reportCollisions("2^20 a/b strings, length 20", &set);
+    freeKeys(&set);
+    decimals(&set);
+    reportCollisions("decimals 0..999999", &set);
+    freeKeys(&set);
+    strideKeys(&set);
+    reportCollisions("\"key\" + multiples of 4096", &set);
+    freeKeys(&set);
+
+    int maxLength = 1 << 20;
+    char* data = malloc(maxLength + 64);
+    for (int i = 0; i < maxLength + 64; i++) {
+        data[i] = (char)("abcdefghijklmnop"[(i * 7) % 16] ^ (i >> 11));
+    }
+
+    printf("\nthroughput, MB/s %8s %8s\n", "fnv1a", "wyhash");
+    int lengths[] = {4, 8, 16, 32, 64, 256, 4096, 1 << 20};
+    for (int i = 0; i < (int)(sizeof(lengths) / sizeof(lengths[0])); i++) {
+        printf("%9d bytes %9.0f %8.0f\n", lengths[i],
+               throughput(fnv1a, data, lengths[i]),
+               throughput(hashString, data, lengths[i]));
+    }
+    free(data);
+    return 0;
+}
@@ -46,8 +46,79 @@ typedef enum {
     OP_CLASS,
     OP_INHERIT,
     OP_METHOD,
+    /*
+     * Superinstructions. The compiler's peephole pass writes these over the
+     * first opcode of the sequence they stand for and leaves the operands in
+     * place, so each one is exactly as long as its sequence:
+     */
+    OP_ADD_LOCALS,                  // GET_LOCAL, GET_LOCAL, ADD
+    OP_ADD_LOCAL_CONSTANT,          // GET_LOCAL, CONSTANT, ADD
+    OP_LESS_LOCAL_CONSTANT_JUMP,    // GET_LOCAL, CONSTANT, LESS, JUMP_IF_FALSE
+    OP_GREATER_LOCAL_CONSTANT_JUMP, // GET_LOCAL, CONSTANT, GREATER, JUMP_IF_FALSE
+    OP_GET_LOCAL_PROPERTY,          // GET_LOCAL, GET_PROPERTY
+    OP_SET_LOCAL_POP,               // SET_LOCAL, POP
+    /*
+     * Register instructions: `dest = a op b` over frame slots, where _RR
+     * takes `b` from a slot and _RK from the constant table. Each is
+     * followed by three operand bytes (dest, a, b) and pushes nothing.
+     */
+    OP_ADD_RR,
+    OP_SUBTRACT_RR,
+    OP_MULTIPLY_RR,
+    OP_DIVIDE_RR,
+    OP_ADD_RK,
+    OP_SUBTRACT_RK,
+    OP_MULTIPLY_RK,
+    OP_DIVIDE_RK,
+    /*
+     * Long forms, emitted in place of the instruction they are named after
+     * when an operand doesn't fit. Constant and name indexes, global slots,
+     * inline cache indexes and jump offsets widen to 24 bits; local and
+     * upvalue slots widen to 16.
+     */
+    OP_CONSTANT_LONG,
+    OP_GET_LOCAL_LONG,
+    OP_SET_LOCAL_LONG,
+    OP_GET_GLOBAL_LONG,
+    OP_DEFINE_GLOBAL_LONG,
+    OP_SET_GLOBAL_LONG,
+    OP_GET_UPVALUE_LONG,
+    OP_SET_UPVALUE_LONG,
+    OP_GET_PROPERTY_LONG,
+    OP_SET_PROPERTY_LONG,
+    OP_GET_SUPER_LONG,
+    OP_JUMP_LONG,
+    OP_JUMP_IF_FALSE_LONG,
+    OP_LOOP_LONG,
+    OP_INVOKE_LONG,
+    OP_SUPER_INVOKE_LONG,
+    OP_CLOSURE_LONG,
+    OP_CLASS_LONG,
+    OP_METHOD_LONG,
 } OpCode;
 
+/*
+ * Inline cache for one OP_GET_PROPERTY, OP_SET_PROPERTY or OP_INVOKE site.
+ * Each way is keyed by a receiver shape, which also pins down the class, and
+ * remembers what the name resolved to for it last time:
+ *   - a field: `target` is NULL and `index` is its slot,
+ *   - a method (get and invoke sites): `target` is the closure,
+ *   - a new field (set sites): `target` is the shape after adding it and
+ *     `index` is the slot it goes in.
+ * A site keeps up to INLINE_CACHE_WAYS shapes, most recently used first.
+ */
+#define INLINE_CACHE_WAYS 4
+
+typedef struct {
+    Obj* shape;
+    Obj* target;
+    int index;
+} CacheWay;
+
+typedef struct {
+    CacheWay ways[INLINE_CACHE_WAYS];
+} InlineCache;
+
 /*
  * Dynamic Array:
  * Cache-friendly, dense storage
@@ -60,6 +131,9 @@ typedef struct {
     uint8_t* code;
     int* lines;
     ValueArray constants;
+    int cacheCount;
+    int cacheCapacity;
+    InlineCache* caches;
 } Chunk;
 
 void initChunk(Chunk* chunk);
@@ -67,5 +141,7 @@ void freeChunk(Chunk* chunk);
 //void writeChunk(Chunk* chunk, uint8_t byte);
 void writeChunk(Chunk* chunk, uint8_t byte, int line);
 int addConstant(Chunk* chunk, Value value);
+int addInlineCache(Chunk* chunk);
+int instructionLength(Chunk* chunk, int offset);
 
 #endif//CLOX_CHUNK_H
@@ -21,5 +21,8 @@
 #define DEBUG_LOG_GC
 
 #define UINT8_COUNT (UINT8_MAX + 1)
+#define UINT16_COUNT (UINT16_MAX + 1)
+// Widest operand of the long instruction forms.
+#define UINT24_MAX 0xffffff
 
 #endif//CLOX_COMMON_H
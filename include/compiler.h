@@ -12,5 +12,7 @@
 //bool compile(const char* source, Chunk* chunk);
 ObjFunction* compile(const char* source);
 void markCompilerRoots();
+// Forgets a compilation cut short by running out of memory.
+void abandonCompile();
 
 #endif//CLOX_COMPILER_H
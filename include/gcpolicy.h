@@ -0,0 +1,53 @@
+//
+// Created by aucker on 10/16/2026.
+//
+
+#ifndef CLOX_GCPOLICY_H
+#define CLOX_GCPOLICY_H
+
+#include "common.h"
+#include "gcstats.h"
+
+#define GC_INITIAL_HEAP (1024 * 1024)
+#define GC_MIN_HEAP (1024 * 1024)
+#define GC_HEAP_GROW_FACTOR 2.0
+// How far the adaptive mode may take the growth factor.
+#define GC_MIN_GROW_FACTOR 1.25
+#define GC_MAX_GROW_FACTOR 8.0
+
+/*
+ * When full collections happen, and how big the heap may get. Sizes count
+ * what reallocate() has handed out, as vm.bytesAllocated does.
+ *
+ * After a full collection, the next one starts once the heap has grown to
+ * `growFactor` times what survived, but never below `minHeap` or above
+ * `maxHeap`. An allocation that would take the heap past `maxHeap` gets a
+ * full collection first. If that doesn't make room, it's an out-of-memory
+ * runtime error. A `maxHeap` of zero is no limit.
+ *
+ * With `targetGCPercent` above zero, `growFactor` is retuned after each
+ * full collection so the collector takes about that share of the time.
+ * Collecting costs roughly the same however much the heap has grown
+ * since the last one, so the time spent is about inversely proportional
+ * to growFactor - 1, and that is scaled by how far off target the last
+ * cycle was.
+ */
+typedef struct {
+    size_t initialHeap;
+    size_t minHeap;
+    size_t maxHeap;
+    double growFactor;
+    double targetGCPercent;
+
+    // For the adaptive mode: the time spent in GC pauses since the last
+    // full collection ended, and when that was.
+    double gcSeconds;
+    double windowStart;
+} GCPolicy;
+
+void initGCPolicy(GCPolicy* policy);
+// Sets a policy from a command-line option like "--heap-max=64M".
+bool parseGCOption(GCPolicy* policy, const char* option);
+size_t nextGCThreshold(GCPolicy* policy, size_t liveBytes);
+
+#endif//CLOX_GCPOLICY_H
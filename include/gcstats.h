@@ -0,0 +1,58 @@
+//
+// Created by aucker on 10/16/2026.
+//
+
+#ifndef CLOX_GCSTATS_H
+#define CLOX_GCSTATS_H
+
+#include <stdio.h>
+
+#include "common.h"
+#include "object.h"
+
+// Pauses are counted by decade: under 10us, under 100us, ... and the last
+// bucket takes everything from 100ms up.
+#define GC_PAUSE_BUCKETS 6
+
+/*
+ * What the collector has done since the VM started. A pause is any stretch
+ * of collecting the VM waits on: a young collection, a slice of a full
+ * one's marking or sweeping, a compaction. Those nest, and only the
+ * outermost counts.
+ *
+ * The per-type numbers count the objects themselves, not the arrays they
+ * own, which are only in the byte totals. What's live of a type is what
+ * was allocated less what was freed.
+ */
+typedef struct {
+    size_t youngCollections;
+    size_t fullCollections;
+    size_t compactions;
+
+    size_t pauses;
+    double pauseSeconds;
+    double maxPauseSeconds;
+    size_t pauseHistogram[GC_PAUSE_BUCKETS];
+
+    size_t bytesAllocated;
+    size_t bytesFreed;
+    size_t objectsAllocated[OBJ_TYPE_COUNT];
+    size_t objectsFreed[OBJ_TYPE_COUNT];
+    size_t objectBytesAllocated[OBJ_TYPE_COUNT];
+    size_t objectBytesFreed[OBJ_TYPE_COUNT];
+
+    int pauseDepth;
+    double pauseStart;
+} GCStats;
+
+// Seconds from some fixed point, for timing the collector.
+double gcClock();
+void initGCStats(GCStats* stats);
+void beginGCPause(GCStats* stats);
+// Returns how long the pause that ended took, or zero if it's still on.
+double endGCPause(GCStats* stats);
+// The plural name of a type, like "strings".
+const char* objectTypeName(ObjType type);
+void printGCStats(GCStats* stats, FILE* file);
+
+#endif//CLOX_GCSTATS_H
@@ -0,0 +1,13 @@
+//
+// Created by aucker on 10/17/2026.
+//
+
+#ifndef CLOX_HASH_H
+#define CLOX_HASH_H
+
+#include "common.h"
+
+// The hash strings are interned and looked up by. See hash.c.
+uint32_t hashString(const char* key, int length);
+
+#endif//CLOX_HASH_H
@@ -0,0 +1,124 @@
+//
+// Created by aucker on 10/16/2026.
+//
+
+#ifndef CLOX_HEAP_H
+#define CLOX_HEAP_H
+
+#include "common.h"
+
+/*
+ * Small blocks, which is every object and most strings' characters, are
+ * carved out of pages the VM owns instead of each being its own malloc().
+ * A page holds blocks of one size class only. Classes are HEAP_GRANULE
+ * bytes apart, up to HEAP_MAX_SMALL; anything bigger goes to libc.
+ *
+ * Pages are HEAP_PAGE_SIZE bytes and aligned to that, so the page a block
+ * lives on is found by masking its address. No block needs a header. They
+ * are mapped from the OS HEAP_CHUNK_PAGES at a time, and unmapped one by
+ * one once they're empty.
+ */
+#define HEAP_PAGE_SIZE (64 * 1024)
+#define HEAP_CHUNK_PAGES 16
+#define HEAP_GRANULE 8
+#define HEAP_MAX_SMALL 256
+#define HEAP_SIZE_CLASSES (HEAP_MAX_SMALL / HEAP_GRANULE)
+
+#define HEAP_PAGE_OF(pointer) \
+    ((HeapPage*)((uintptr_t)(pointer) & ~(uintptr_t)(HEAP_PAGE_SIZE - 1)))
+
+/*
+ * Per-page bitmaps have a bit for every granule of the page, and the bit
+ * for a block is the one of its first granule.
+ */
+#define HEAP_BITMAP_WORDS (HEAP_PAGE_SIZE / HEAP_GRANULE / 64)
+#define HEAP_BIT_INDEX(pointer) \
+    (((uintptr_t)(pointer) & (HEAP_PAGE_SIZE - 1)) / HEAP_GRANULE)
+#define HEAP_BIT_WORD(pointer) (HEAP_BIT_INDEX(pointer) / 64)
+#define HEAP_BIT_MASK(pointer) ((uint64_t)1 << (HEAP_BIT_INDEX(pointer) % 64))
+#define HEAP_BLOCK_SIZE(page) ((size_t)((page)->sizeClass + 1) * HEAP_GRANULE)
+// Where the block for bit `bit` of word `word` starts.
+#define HEAP_BLOCK_AT(page, word, bit) \
+    ((void*)((char*)(page) + ((size_t)(word) * 64 + (bit)) * HEAP_GRANULE))
+
+typedef struct HeapPage {
+    // Every page in use.
+    struct HeapPage* prev;
+    struct HeapPage* next;
+    // Neighbors in its class's list of pages with room. A full page isn't
+    // in it.
+    struct HeapPage* prevOpen;
+    struct HeapPage* nextOpen;
+    // Freed blocks, each holding a pointer to the next one.
+    void* freeList;
+    // Blocks from here to `end` were never handed out.
+    char* bump;
+    char* end;
+    int sizeClass;
+    int liveCount;
+    // Being emptied by a compaction. Its objects have moved out and left a
+    // forwarding pointer behind, see compactHeap().
+    bool isEvacuating;
+    // Waiting on `emptyPages` to be released.
+    bool isQueued;
+    // Links `emptyPages`, or `freePages` once the page is released.
+    struct HeapPage* nextEmpty;
+    // Set for the blocks that hold an object, so the collector can find
+    // them without a list.
+    uint64_t objectBits[HEAP_BITMAP_WORDS];
+    // The collector's mark bits. They live off the page, so marking never
+    // writes to it and a forked process keeps sharing it.
+    uint64_t* markBits;
+} HeapPage;
+
+/*
+ * A page whose last block is freed isn't released straight away, or a
+ * loop allocating and dropping one object would get a fresh page every
+ * time. It is queued on `emptyPages` and the collector calls
+ * releaseEmptyPages() after sweeping, which moves it to `freePages` for
+ * any class to reuse. Only trimHeap() gives those back to the OS.
+ */
+typedef struct {
+    HeapPage* pages;
+    HeapPage* openPages[HEAP_SIZE_CLASSES];
+    HeapPage* emptyPages;
+    HeapPage* freePages;
+    int pageCount;
+    int freePageCount;
+    // What's left of the last chunk mapped.
+    char* chunkNext;
+    char* chunkEnd;
+} Heap;
+
+void initHeap(Heap* heap);
+void freeHeap(Heap* heap);
+void* heapReallocate(Heap* heap, void* pointer, size_t oldSize,
+                     size_t newSize);
+void releaseEmptyPages(Heap* heap);
+void trimHeap(Heap* heap);
+void clearMarkBits(Heap* heap);
+int heapOccupancy(Heap* heap);
+int selectEvacuationPages(Heap* heap, int occupancy);
+void releaseEvacuatedPages(Heap* heap);
+
+// Tells the heap `block` holds an object. Freeing the block forgets it.
+static inline void tagObjectBlock(void* block) {
+    HEAP_PAGE_OF(block)->objectBits[HEAP_BIT_WORD(block)] |=
+            HEAP_BIT_MASK(block);
+}
+
+// Index of the lowest set bit in a word that isn't zero.
+static inline int lowestBit(uint64_t word) {
+#if defined(__GNUC__) || defined(__clang__)
+    return __builtin_ctzll(word);
+#else
+    int bit = 0;
+    while ((word & 1) == 0) {
+        word >>= 1;
+        bit++;
+    }
+    return bit;
+#endif
+}
+
+#endif//CLOX_HEAP_H
@@ -0,0 +1,26 @@
+//
+// Created by aucker on 10/16/2026.
+//
+
+#ifndef CLOX_MARKER_H
+#define CLOX_MARKER_H
+
+#include "common.h"
+#include "object.h"
+
+/*
+ * The parallel marker. A full collection of a big enough heap traces from
+ * the gray stack on vm.gcMarkThreads threads while the VM waits. Each
+ * thread has a gray deque of its own: it pushes and pops at one end, and a
+ * thread that runs dry steals from the other end of someone else's. Mark
+ * bits are set with an atomic or, so two threads reaching an object at
+ * once can't both gray it.
+ *
+ * Only built with PARALLEL_MARK, which needs POSIX threads.
+ */
+int defaultMarkThreads();
+void traceInParallel(int threadCount);
+// What markObject() does on a marking thread.
+void markObjectInParallel(Obj* object);
+
+#endif//CLOX_MARKER_H
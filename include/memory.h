@@ -7,6 +7,7 @@
 
 #include "common.h"
 #include "object.h"
+#include "vm.h"
 
 #define ALLOCATE(type, count) \
     (type*) reallocate(NULL, 0, sizeof(type) * (count))
@@ -16,6 +17,38 @@
  * trade-off between extra grows versus wasted space.
  */
 
+// Bytes allocated between young collections.
+#define NURSERY_SIZE (256 * 1024)
+
+// Marking work done per allocation while a full collection is underway.
+#ifdef DEBUG_STRESS_GC
+#define GC_SLICE_BUDGET 16
+#else
+#define GC_SLICE_BUDGET 2048
+#endif
+
+// A full collection that leaves the heap pages less than this percent full
+// asks for a compaction, see compactHeap().
+#ifdef DEBUG_STRESS_GC
+#define GC_COMPACT_OCCUPANCY 100
+#else
+#define GC_COMPACT_OCCUPANCY 50
+#endif
+
+// A full collection starting on a heap of at least this many bytes marks
+// it all in one pause, on gcMarkThreads threads. Needs PARALLEL_MARK.
+// Stress runs use a small threshold, so that their bigger heaps take the
+// parallel path and the rest still mark a slice at a time.
+#ifdef DEBUG_STRESS_GC
+#define GC_PARALLEL_MARK_BYTES (1024 * 1024)
+#define GC_MARK_THREADS 4
+#else
+#define GC_PARALLEL_MARK_BYTES (32 * 1024 * 1024)
+// Zero is one per core, up to GC_MAX_MARK_THREADS.
+#define GC_MARK_THREADS 0
+#endif
+#define GC_MAX_MARK_THREADS 16
+
 #define FREE(type, pointer) reallocate(pointer, sizeof(type), 0)
 
 #define GROW_CAPACITY(capacity) \
@@ -29,9 +62,70 @@
     reallocate(pointer, sizeof(type) * (oldCount), 0)
 
 void* reallocate(void* pointer, size_t oldSize, size_t newSize);
+
+/*
+ * Brackets anything outside reallocate() that touches the heap's bitmaps
+ * or the intern table, which a background sweep shares with the VM.
+ */
+#ifdef CONCURRENT_SWEEP
+void acquireHeapLock();
+void releaseHeapLock();
+
+static inline void lockHeap() {
+    if (vm.heapLockDepth++ == 0 && vm.sweeperRunning) acquireHeapLock();
+}
+
+static inline void unlockHeap() {
+    if (--vm.heapLockDepth == 0 && vm.heapLockTaken) releaseHeapLock();
+}
+#else
+static inline void lockHeap() {}
+static inline void unlockHeap() {}
+#endif
+
+// Mark bits are kept in a bitmap beside the object's heap page.
+static inline bool isMarked(Obj* object) {
+    return (HEAP_PAGE_OF(object)->markBits[HEAP_BIT_WORD(object)] &
+            HEAP_BIT_MASK(object)) != 0;
+}
+
+static inline void setMarked(Obj* object) {
+    HEAP_PAGE_OF(object)->markBits[HEAP_BIT_WORD(object)] |=
+            HEAP_BIT_MASK(object);
+}
+
+void rememberObject(Obj* object);
 void markObject(Obj* object);
+
+/*
+ * The write barrier. Call it after storing `value` into a field of `owner`
+ * (an instance field, a table inside it, anything blackenObject() traces).
+ * An old object that now points at a young one has to be remembered, since
+ * a young collection doesn't look at old objects otherwise. And while a full
+ * collection is marking, a marked object must never point at an unmarked
+ * one that the marker might not reach any more, so the value gets grayed.
+ */
+static inline void writeBarrier(Obj* owner, Value value) {
+    if (!IS_OBJ(value)) return;
+    Obj* object = AS_OBJ(value);
+    if (owner->isOld && !owner->isRemembered && !object->isOld) {
+        rememberObject(owner);
+    }
+    if (vm.gcPhase == GC_MARK && isMarked(owner) && !isMarked(object)) {
+        markObject(object);
+    }
+}
+
+// For when too many references in `owner` changed to barrier each one.
+void writeBarrierAll(Obj* owner);
+
 void markValue(Value value);
+int blackenObject(Obj* object);
 void collectGarbage();
+void completeSweep();
+void setGCPolicy(GCPolicy* policy);
+void readGCStats(GCStats* stats);
+void compactHeap();
 void freeObjects();
 
 #endif//CLOX_MEMORY_H
@@ -7,6 +7,7 @@
 
 #include "chunk.h"
 #include "common.h"
+#include "heap.h"
 #include "table.h"
 #include "value.h"
 
@@ -18,6 +19,7 @@
 #define IS_FUNCTION(value) isObjType(value, OBJ_FUNCTION)
 #define IS_INSTANCE(value) isObjType(value, OBJ_INSTANCE)
 #define IS_NATIVE(value) isObjType(value, OBJ_NATIVE)
+#define IS_SHAPE(value) isObjType(value, OBJ_SHAPE)
 #define IS_STRING(value) isObjType(value, OBJ_STRING)
 
 #define AS_BOUND_METHOD(value) ((ObjBoundMethod*)AS_OBJ(value))
@@ -27,6 +29,7 @@
 #define AS_INSTANCE(value) ((ObjInstance*)AS_OBJ(value))
 #define AS_NATIVE(value) \
     (((ObjNative *) AS_OBJ(value))->function)
+#define AS_SHAPE(value) ((ObjShape*)AS_OBJ(value))
 #define AS_STRING(value) ((ObjString *) AS_OBJ(value))
 #define AS_CSTRING(value) (((ObjString *) AS_OBJ(value))->chars)
 
@@ -37,13 +40,21 @@ typedef enum {
     OBJ_FUNCTION,
     OBJ_INSTANCE,
     OBJ_NATIVE,
+    OBJ_SHAPE,
     OBJ_STRING,
     OBJ_UPVALUE,
 } ObjType;
 
+#define OBJ_TYPE_COUNT (OBJ_UPVALUE + 1)
+
 struct Obj {
     ObjType type;
-    bool isMarked;
+    // Survived a collection, so is no longer on the nursery list. Its mark
+    // bit is on its heap page, see heap.h.
+    bool isOld;
+    // Old, and in vm.remembered because it may point at young objects.
+    bool isRemembered;
+    // The next young object.
     struct Obj *next;
 };
 
@@ -51,6 +62,8 @@ typedef struct {
     Obj obj;
     int arity;
     int upvalueCount;
+    // Most locals live at once, so call() can check the stack has room.
+    int slotCount;
     Chunk chunk;
     ObjString *name;
 } ObjFunction;
@@ -62,13 +75,48 @@ typedef struct {
     NativeFn function;
 } ObjNative;
 
+// Concatenations shorter than this are copied out right away.
+#define ROPE_MIN_LENGTH 64
+// Strings made at least this long aren't interned until they're a key.
+#define UNINTERNED_MIN_LENGTH 64
+
+/*
+ * A string's characters are NUL terminated and usually stored in the
+ * object itself, with `chars` pointing at `inlineChars`, so the string is
+ * one allocation and the intern table finds its characters right behind
+ * its header. Only strings too long for the object to fit a heap size
+ * class keep them in a separate block.
+ *
+ * A string built by concatenation at run time may be a rope instead: its
+ * `chars` are NULL, and it's the characters of `left` followed by those of
+ * `right`. Nothing is copied until something needs the characters, see
+ * flattenString(), so a loop appending to a string costs a small object
+ * per step instead of a copy of everything so far.
+ *
+ * Only strings that may be used as names are interned as they're made:
+ * short ones from copyString() and takeString(). Long strings, ropes and
+ * the results of concatenation aren't, as interning costs a hash and a
+ * probe of the intern table and most of them are never a key. So two
+ * equal strings can be different objects, and only when both are
+ * `isInterned` does comparing the pointers settle it, see stringsEqual().
+ * The others compare by length, then characters. Their `hash` is only set
+ * once internString() makes them keys.
+ */
 struct ObjString {
     Obj obj;
     int length;
-    char *chars;
     uint32_t hash;
+    char *chars;
+    struct ObjString* left;
+    struct ObjString* right;
+    bool isInterned;
+    char inlineChars[];
 };
 
+#define STRING_HEADER_SIZE offsetof(ObjString, inlineChars)
+// The longest string whose characters fit in the object.
+#define MAX_INLINE_CHARS ((int)(HEAP_MAX_SMALL - STRING_HEADER_SIZE - 1))
+
 typedef struct ObjUpvalue {
     Obj obj;
     Value* location;
@@ -84,17 +132,44 @@ typedef struct {
     int upvalueCount;
 } ObjClosure;
 
+/*
+ * A shape (hidden class) describes the field layout shared by every instance
+ * that added the same fields in the same order: `slots` maps each field name
+ * to its index in the instance's field array. Adding a field moves the
+ * instance to the child shape in `transitions`, created on first use, so
+ * shapes form a tree rooted at the empty shape of each class.
+ */
+typedef struct ObjShape {
+    Obj obj;
+    Table slots;
+    Table transitions;
+    int fieldCount;
+} ObjShape;
+
 // Another struct, this is for class in clox
 typedef struct {
     Obj obj;
     ObjString* name;
     Table methods;
+    ObjShape* shape;
+    // How many fields new instances reserve inline, learned from the
+    // instances that had to grow.
+    int fieldHint;
 } ObjClass;
 
+/*
+ * Field values are stored by slot index from `shape`. `fields` points at
+ * the inline array allocated along with the instance, or at a separate heap
+ * array once the instance outgrows it.
+ */
 typedef struct {
     Obj obj;
     ObjClass* klass;
-    Table fields;
+    ObjShape* shape;
+    Value* fields;
+    int capacity;
+    int inlineCapacity;
+    Value inlineFields[];
 } ObjInstance;
 
 typedef struct {
@@ -109,8 +184,16 @@ ObjClosure* newClosure(ObjFunction* function);
 ObjFunction *newFunction();
 ObjInstance* newInstance(ObjClass* klass);
 ObjNative *newNative(NativeFn function);
+int shapeSlot(ObjShape* shape, ObjString* name);
+ObjShape* shapeTransition(ObjShape* shape, ObjString* name);
+bool getField(ObjInstance* instance, ObjString* name, Value* value);
+int addField(ObjInstance* instance, ObjString* name, Value value);
 ObjString *takeString(char *chars, int length);
 ObjString *copyString(const char *chars, int length);
+ObjString* internString(ObjString* string);
+ObjString* concatenateStrings(ObjString* a, ObjString* b);
+void flattenString(ObjString* string);
+bool stringsEqual(ObjString* a, ObjString* b);
 ObjUpvalue* newUpvalue(Value* slot);
 void printObject(Value value);
 
@@ -118,4 +201,10 @@ static inline bool isObjType(Value value, ObjType type) {
     return IS_OBJ(value) && AS_OBJ(value)->type == type;
 }
 
+// The size of the string's own block, inline characters included.
+static inline size_t stringSize(ObjString* string) {
+    if (string->chars != string->inlineChars) return STRING_HEADER_SIZE;
+    return STRING_HEADER_SIZE + string->length + 1;
+}
+
 #endif//CLOX_OBJECT_H
@@ -34,7 +34,16 @@ typedef struct {
     int line;
 } Token;
 
+typedef struct {
+    const char* start;
+    const char* current;
+    int line;
+} Scanner;
+
 void initScanner(const char* source);
 Token scanToken();
+// For the compiler to rewind and compile a stretch of source again.
+Scanner saveScanner();
+void restoreScanner(Scanner state);
 
 #endif//CLOX_SCANNER_H
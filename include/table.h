@@ -13,12 +13,32 @@ typedef struct {
     Value value;
 } Entry;
 
+// Slots whose control bytes one probe step looks at together.
+#define TABLE_GROUP_WIDTH 16
+
+/*
+ * An open-addressing table in the style of Abseil's Swiss tables. The
+ * capacity is a power of two, and `entries` is one block: the entries,
+ * then a control byte per slot, then the first TABLE_GROUP_WIDTH of those
+ * again so a group starting near the end can be read without wrapping.
+ * A full slot's control byte is seven bits of its key's hash, so a lookup
+ * compares a whole group of them at once and only looks at the entries
+ * that might hold the key.
+ *
+ * `count` is the live entries and `tombstones` the deleted slots a probe
+ * still has to step over.
+ */
 typedef struct {
     int count;
+    int tombstones;
     int capacity;
     Entry* entries;
 } Table;
 
+static inline size_t tableBlockSize(int capacity) {
+    return sizeof(Entry) * capacity + capacity + TABLE_GROUP_WIDTH;
+}
+
 void initTable(Table* table);
 void freeTable(Table* table);
 bool tableGet(Table* table, ObjString* key, Value* value);
@@ -27,7 +47,6 @@ bool tableDelete(Table* table, ObjString* key);
 void tableAddAll(Table* from, Table* to);
 ObjString* tableFindString(Table* table, const char* chars,
                            int length, uint32_t hash);
-void tableRemoveWhite(Table* table);
 void markTable(Table* table);
 
 #endif//CLOX_TABLE_H
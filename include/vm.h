@@ -4,8 +4,11 @@
 #ifndef CLOX_VM_H
 #define CLOX_VM_H
 
+#include <setjmp.h>
 
 //#include "chunk.h"
+#include "gcpolicy.h"
+#include "heap.h"
 #include "object.h"
 #include "table.h"
 #include "value.h"
@@ -14,6 +17,12 @@
 #define FRAMES_MAX 64
 #define STACK_MAX (FRAMES_MAX * UINT8_COUNT)
 
+typedef enum {
+    GC_IDLE,
+    GC_MARK,
+    GC_SWEEP,
+} GCPhase;
+
 typedef struct {
 //    ObjFunction* function;
     ObjClosure* closure;
@@ -23,9 +32,9 @@ typedef struct {
 
 
 /*
- * If we were trying to squeeze every ounce of speed out of our bytecode interpreter,
- * we would store `in` in a local variable. It gets modified so often during execution
- * that we want the C compiler to keep it in a register.
+ * run() keeps `ip` and `stackTop` for the active frame in locals so the C compiler
+ * can hold them in registers. The copies here are only current at points where run()
+ * spills them back: before calls, allocations and runtime errors.
  */
 typedef struct {
 //    Chunk* chunk;
@@ -35,14 +44,86 @@ typedef struct {
 
     Value stack[STACK_MAX];
     Value* stackTop;
-    Table globals;
+    /*
+     * The compiler resolves every global name to a slot. `globalSlots` maps
+     * names to slot numbers, `globalNames` maps them back for error messages,
+     * and `globalValues` holds the values, UNDEFINED_VAL until defined.
+     */
+    Table globalSlots;
+    ValueArray globalNames;
+    ValueArray globalValues;
     Table strings;
     ObjString* initString;
+    // What gcStats() returns instances of. Made once, so calling it doesn't
+    // make classes and shapes of its own, and its results share a shape.
+    ObjClass* gcStatsClass;
+    ObjClass* gcTypeStatsClass;
     ObjUpvalue* openUpvalues;
 
+    // Pages every small block is allocated from. See heap.h.
+    Heap heap;
     size_t bytesAllocated;
     size_t nextGC;
-    Obj* objects;
+    // When full collections start and how big the heap may grow.
+    GCPolicy gcPolicy;
+    // What the collector has done so far, see readGCStats().
+    GCStats gcStats;
+    /*
+     * Where running out of memory unwinds to, while interpret() is running.
+     * Otherwise it's NULL, and the process exits.
+     */
+    jmp_buf* errorJump;
+    /*
+     * The heap is split in two generations. New objects go on `youngObjects`
+     * and a young collection, run every NURSERY_SIZE bytes of allocation,
+     * traces only those: old objects count as live, and the ones in
+     * `remembered` as roots. Whatever survives is promoted to old, and
+     * from then on is found by walking the heap pages.
+     */
+    size_t nextYoungGC;
+    Obj* youngObjects;
+    bool collectingYoung;
+    int rememberedCount;
+    int rememberedCapacity;
+    Obj** remembered;
+    /*
+     * A full collection marks incrementally. It starts once `nextGC` is
+     * passed and then every allocation traces up to `gcSliceBudget` units
+     * of work (about one per reference scanned) until the gray stack runs
+     * dry. A budget of zero or less marks everything in one pause. The
+     * old generation is then swept the same way, a few heap pages per
+     * allocation, from `sweepPage` on.
+     */
+    GCPhase gcPhase;
+    int gcSliceBudget;
+    HeapPage* sweepPage;
+    /*
+     * Objects only move at run()'s safe points, so a full collection that
+     * finds the pages less than `gcCompactOccupancy` percent full sets
+     * `compactRequested` and the next safe point compacts. Zero or less
+     * never compacts. Needs COMPACTING_GC.
+     */
+    int gcCompactOccupancy;
+    bool compactRequested;
+    /*
+     * A full collection starting with at least `gcParallelMarkBytes`
+     * allocated marks on `gcMarkThreads` threads, see marker.h. One thread
+     * or fewer always marks serially. Needs PARALLEL_MARK.
+     */
+    int gcMarkThreads;
+    size_t gcParallelMarkBytes;
+    bool markingInParallel;
+    /*
+     * With `gcSweepInBackground` set, the sweep after a full collection
+     * runs on a thread of its own while the VM goes on, and
+     * `sweeperRunning` is set until the VM has joined it. Meanwhile the VM
+     * takes the heap lock for what it shares with it, counting how deep in
+     * lockHeap() it is. Needs CONCURRENT_SWEEP.
+     */
+    bool gcSweepInBackground;
+    bool sweeperRunning;
+    int heapLockDepth;
+    bool heapLockTaken;
     int grayCount;
     int grayCapacity;
     Obj** grayStack;
@@ -60,6 +141,7 @@ extern VM vm;
 
 void initVM();
 void freeVM();
+int globalSlot(ObjString* name);
 //InterpretResult interpret(Chunk* chunk);
 InterpretResult interpret(const char* source);
 void push(Value value);
@@ -13,12 +13,16 @@ void initChunk(Chunk* chunk) {
     chunk->code = NULL;
     chunk->lines = NULL;
     initValueArray(&chunk->constants);
+    chunk->cacheCount = 0;
+    chunk->cacheCapacity = 0;
+    chunk->caches = NULL;
 }
 
 void freeChunk(Chunk* chunk) {
     FREE_ARRAY(uint8_t, chunk->code, chunk->capacity);
     FREE_ARRAY(int, chunk->lines, chunk->capacity);
     freeValueArray(&chunk->constants);
+    FREE_ARRAY(InlineCache, chunk->caches, chunk->cacheCapacity);
     initChunk(chunk);
 }
 
@@ -43,3 +47,99 @@ int addConstant(Chunk* chunk, Value value) {
     pop();
     return chunk->constants.count - 1;
 }
+
+int instructionLength(Chunk* chunk, int offset) {
+    switch ((OpCode)chunk->code[offset]) {
+        case OP_CONSTANT:
+        case OP_GET_LOCAL:
+        case OP_SET_LOCAL:
+        case OP_GET_UPVALUE:
+        case OP_SET_UPVALUE:
+        case OP_GET_SUPER:
+        case OP_CALL:
+        case OP_CLASS:
+        case OP_METHOD:
+            return 2;
+        case OP_GET_GLOBAL:
+        case OP_DEFINE_GLOBAL:
+        case OP_SET_GLOBAL:
+        case OP_JUMP:
+        case OP_JUMP_IF_FALSE:
+        case OP_LOOP:
+        case OP_SUPER_INVOKE:
+        case OP_SET_LOCAL_POP:
+        case OP_GET_LOCAL_LONG:
+        case OP_SET_LOCAL_LONG:
+        case OP_GET_UPVALUE_LONG:
+        case OP_SET_UPVALUE_LONG:
+            return 3;
+        case OP_ADD_RR:
+        case OP_SUBTRACT_RR:
+        case OP_MULTIPLY_RR:
+        case OP_DIVIDE_RR:
+        case OP_ADD_RK:
+        case OP_SUBTRACT_RK:
+        case OP_MULTIPLY_RK:
+        case OP_DIVIDE_RK:
+            return 4;
+        case OP_GET_PROPERTY:
+        case OP_SET_PROPERTY:
+        case OP_CONSTANT_LONG:
+        case OP_GET_GLOBAL_LONG:
+        case OP_DEFINE_GLOBAL_LONG:
+        case OP_SET_GLOBAL_LONG:
+        case OP_GET_SUPER_LONG:
+        case OP_JUMP_LONG:
+        case OP_JUMP_IF_FALSE_LONG:
+        case OP_LOOP_LONG:
+        case OP_CLASS_LONG:
+        case OP_METHOD_LONG:
+            return 4;
+        case OP_INVOKE:
+        case OP_ADD_LOCALS:
+        case OP_ADD_LOCAL_CONSTANT:
+        case OP_SUPER_INVOKE_LONG:
+            return 5;
+        case OP_GET_LOCAL_PROPERTY:
+            return 6;
+        case OP_GET_PROPERTY_LONG:
+        case OP_SET_PROPERTY_LONG:
+            return 7;
+        case OP_LESS_LOCAL_CONSTANT_JUMP:
+        case OP_GREATER_LOCAL_CONSTANT_JUMP:
+        case OP_INVOKE_LONG:
+            return 8;
+        // Each captured variable is an isLocal byte and a 16-bit index.
+        case OP_CLOSURE: {
+            ObjFunction* function = AS_FUNCTION(
+                    chunk->constants.values[chunk->code[offset + 1]]);
+            return 2 + function->upvalueCount * 3;
+        }
+        case OP_CLOSURE_LONG: {
+            uint8_t* operand = &chunk->code[offset + 1];
+            int constant = (operand[0] << 16) | (operand[1] << 8) | operand[2];
+            ObjFunction* function = AS_FUNCTION(
+                    chunk->constants.values[constant]);
+            return 4 + function->upvalueCount * 3;
+        }
+        default:
+            return 1;
+    }
+}
+
+int addInlineCache(Chunk* chunk) {
+    if (chunk->cacheCapacity < chunk->cacheCount + 1) {
+        int oldCapacity = chunk->cacheCapacity;
+        chunk->cacheCapacity = GROW_CAPACITY(oldCapacity);
+        chunk->caches = GROW_ARRAY(InlineCache, chunk->caches,
+                                   oldCapacity, chunk->cacheCapacity);
+    }
+
+    InlineCache* cache = &chunk->caches[chunk->cacheCount];
+    for (int i = 0; i < INLINE_CACHE_WAYS; i++) {
+        cache->ways[i].shape = NULL;
+        cache->ways[i].target = NULL;
+        cache->ways[i].index = -1;
+    }
+    return chunk->cacheCount++;
+}
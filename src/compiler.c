@@ -8,11 +8,11 @@
 
 #include "common.h"
 #include "compiler.h"
+#include "memory.h"
 #include "scanner.h"
 
 #ifdef DEBUG_PRINT_CODE
 #include "debug.h"
-#include "memory.h"
 #endif
 
 typedef struct {
@@ -57,7 +57,7 @@ typedef struct {
 } Local;
 
 typedef struct {
-    uint8_t index;
+    uint16_t index;
     bool isLocal;
 } Upvalue;
 
@@ -74,15 +74,42 @@ typedef enum {
     TYPE_SCRIPT,
 } FunctionType;
 
+/*
+ * A constant expression sitting at the end of the chunk: the single
+ * instruction at [start, end) loads `value`. `constants` is the size of the
+ * constant table before it was emitted, so folding it away can give its
+ * constant back too.
+ */
+typedef struct {
+    int start;
+    int end;
+    int constants;
+    Value value;
+} ConstantExpr;
+
+#define MAX_CONSTANT_EXPRS 16
+
 typedef struct Compiler {
     struct Compiler* enclosing;
     ObjFunction* function;
     FunctionType type;
 
-    Local locals[UINT8_COUNT];
+    // Both grow as needed, up to UINT16_COUNT entries.
+    Local* locals;
     int localCount;
-    Upvalue upvalues[UINT8_COUNT];
+    int localCapacity;
+    Upvalue* upvalues;
+    int upvalueCapacity;
     int scopeDepth;
+    // Forward jumps are emitted with 24-bit offsets instead of 16-bit.
+    bool longJumps;
+    // A 16-bit jump came out too far. See function().
+    bool jumpOverflow;
+    // Offset of the GET_LOCAL that follows the last register instruction.
+    int registerResult;
+    // Operands the constant folder may still combine, innermost last.
+    ConstantExpr constantExprs[MAX_CONSTANT_EXPRS];
+    int constantExprCount;
 } Compiler;
 
 typedef struct ClassCompiler {
@@ -170,20 +197,39 @@ static void emitBytes(uint8_t byte1, uint8_t byte2) {
     emitByte(byte2);
 }
 
-static void emitLoop(int loopStart) {
-    emitByte(OP_LOOP);
+// Emits `operand` big-endian in `width` bytes.
+static void emitOperand(int operand, int width) {
+    for (int shift = (width - 1) * 8; shift >= 0; shift -= 8) {
+        emitByte((operand >> shift) & 0xff);
+    }
+}
 
-    int offset = currentChunk()->count - loopStart + 2;
-    if (offset > UINT16_MAX) error("Loop body too large.");
+static void emitLoop(int loopStart) {
+    // The offset counts from the end of the instruction, operand included.
+    int offset = currentChunk()->count - loopStart + 3;
+    if (offset <= UINT16_MAX) {
+        emitByte(OP_LOOP);
+        emitOperand(offset, 2);
+        return;
+    }
 
-    emitByte((offset >> 8) & 0xff);
-    emitByte(offset & 0xff);
+    offset++;
+    if (offset > UINT24_MAX) error("Loop body too large.");
+    emitByte(OP_LOOP_LONG);
+    emitOperand(offset, 3);
 }
 
-static int emitJump(uint8_t instruction) {
+// A backward jump knows how far it goes, but a forward one doesn't until it
+// is patched, so whether it is long is decided for the whole function.
+static int emitJump(uint8_t instruction, uint8_t longInstruction) {
+    if (current->longJumps) {
+        emitByte(longInstruction);
+        emitOperand(UINT24_MAX, 3);
+        return currentChunk()->count - 3;
+    }
+
     emitByte(instruction);
-    emitByte(0xff);
-    emitByte(0xff);
+    emitOperand(UINT16_MAX, 2);
     return currentChunk()->count - 2;
 }
 
@@ -198,30 +244,164 @@ static void emitReturn() {
     emitByte(OP_RETURN);
 }
 
-static uint8_t makeConstant(Value value) {
+static int makeConstant(Value value) {
     int constant = addConstant(currentChunk(), value);
-    if (constant > UINT8_MAX) {
+    writeBarrier((Obj*)current->function, value);
+    if (constant > UINT24_MAX) {
         error("Too many constants in one chunk.");
         return 0;
     }
 
-    return (uint8_t)constant;
+    return constant;
+}
+
+// Emits `op` with a one-byte constant operand, or `longOp` with a 24-bit one
+// if the constant is past the first 256.
+static void emitConstantOp(uint8_t op, uint8_t longOp, int constant) {
+    if (constant <= UINT8_MAX) {
+        emitBytes(op, (uint8_t)constant);
+    } else {
+        emitByte(longOp);
+        emitOperand(constant, 3);
+    }
+}
+
+/*
+ * Property and invoke instructions carry the name constant and a 16-bit
+ * index into the chunk's inline caches, one per call site. OP_INVOKE has
+ * its argument count in between. If either index doesn't fit, the long
+ * form widens both to 24 bits.
+ */
+static void emitPropertyOp(uint8_t op, uint8_t longOp, int name,
+                           uint8_t argCount) {
+    int cache = addInlineCache(currentChunk());
+    if (cache > UINT24_MAX) {
+        error("Too many property accesses in one chunk.");
+        cache = 0;
+    }
+
+    bool isLong = name > UINT8_MAX || cache > UINT16_MAX;
+    emitByte(isLong ? longOp : op);
+    emitOperand(name, isLong ? 3 : 1);
+    if (op == OP_INVOKE) emitByte(argCount);
+    emitOperand(cache, isLong ? 3 : 2);
+}
+
+/*
+ * Constant folding. Every literal, and every expression folded from
+ * literals, is recorded as it's emitted. When an operator finds that its
+ * operands are the records at the very end of the chunk, it truncates their
+ * code and emits the result instead. Any jump target, or the start of a new
+ * statement, clears the records, since code before that point may no longer
+ * belong to the expression being compiled.
+ */
+static void recordConstant(int start, int constants, Value value) {
+    if (current->constantExprCount == MAX_CONSTANT_EXPRS) {
+        memmove(&current->constantExprs[0], &current->constantExprs[1],
+                sizeof(ConstantExpr) * (MAX_CONSTANT_EXPRS - 1));
+        current->constantExprCount--;
+    }
+
+    ConstantExpr* expr = &current->constantExprs[current->constantExprCount++];
+    expr->start = start;
+    expr->end = currentChunk()->count;
+    expr->constants = constants;
+    expr->value = value;
+}
+
+// The constant expression that ends the chunk, if there is one.
+static ConstantExpr* lastConstant() {
+    if (current->constantExprCount == 0) return NULL;
+
+    ConstantExpr* expr = &current->constantExprs[current->constantExprCount - 1];
+    if (expr->end != currentChunk()->count) return NULL;
+    return expr;
+}
+
+// The constant expression that makes up all the code from `start` on.
+static ConstantExpr* constantFrom(int start) {
+    ConstantExpr* expr = lastConstant();
+    if (expr == NULL || expr->start != start) return NULL;
+    return expr;
+}
+
+// Throws away the code emitted from `offset` on.
+static void truncateCode(int offset) {
+    currentChunk()->count = offset;
+    while (current->constantExprCount > 0 &&
+           current->constantExprs[current->constantExprCount - 1].end > offset) {
+        current->constantExprCount--;
+    }
+    if (current->registerResult >= offset) current->registerResult = -1;
+}
+
+// Removes the constant expression that ends the chunk, code and constant.
+static void dropConstant() {
+    ConstantExpr expr = current->constantExprs[current->constantExprCount - 1];
+    truncateCode(expr.start);
+    currentChunk()->constants.count = expr.constants;
+}
+
+static void emitLiteral(OpCode op, Value value) {
+    int start = currentChunk()->count;
+    emitByte(op);
+    recordConstant(start, currentChunk()->constants.count, value);
 }
 
 static void emitConstant(Value value) {
-    emitBytes(OP_CONSTANT, makeConstant(value));
+    int start = currentChunk()->count;
+    int constants = currentChunk()->constants.count;
+    emitConstantOp(OP_CONSTANT, OP_CONSTANT_LONG, makeConstant(value));
+    recordConstant(start, constants, value);
 }
 
-static void patchJump(int offset) {
-    // -2 to adjust for the bytecode for the jump offset itself
-    int jump = currentChunk()->count - offset - 2;
+static void emitFolded(Value value) {
+    if (IS_BOOL(value)) {
+        emitLiteral(AS_BOOL(value) ? OP_TRUE : OP_FALSE, value);
+    } else {
+        emitConstant(value);
+    }
+}
 
-    if (jump > UINT16_MAX) {
+static bool isFalseyConstant(Value value) {
+    return IS_NIL(value) || (IS_BOOL(value) && !AS_BOOL(value));
+}
+
+static void patchJump(int offset) {
+    int width = current->longJumps ? 3 : 2;
+    // -width to adjust for the bytecode for the jump offset itself
+    int jump = currentChunk()->count - offset - width;
+
+    if (!current->longJumps && jump > UINT16_MAX) {
+        // Not an error yet: the function gets compiled again with long jumps.
+        current->jumpOverflow = true;
+    } else if (jump > UINT24_MAX) {
         error("Too much code to jump over.");
     }
 
-    currentChunk()->code[offset] = (jump >> 8) & 0xff;
-    currentChunk()->code[offset + 1] = jump & 0xff;
+    for (int i = 0; i < width; i++) {
+        currentChunk()->code[offset + i] =
+                (jump >> ((width - 1 - i) * 8)) & 0xff;
+    }
+    // Code a jump lands on can't be folded or dropped any more.
+    current->constantExprCount = 0;
+    current->registerResult = -1;
+}
+
+// Claims the next local slot, growing the array if it is full.
+static Local* appendLocal(Compiler* compiler) {
+    if (compiler->localCount == compiler->localCapacity) {
+        int oldCapacity = compiler->localCapacity;
+        compiler->localCapacity = GROW_CAPACITY(oldCapacity);
+        compiler->locals = GROW_ARRAY(Local, compiler->locals,
+                                      oldCapacity, compiler->localCapacity);
+    }
+
+    Local* local = &compiler->locals[compiler->localCount++];
+    if (compiler->localCount > compiler->function->slotCount) {
+        compiler->function->slotCount = compiler->localCount;
+    }
+    return local;
 }
 
 //static void initCompiler(Compiler* compiler) {
@@ -229,16 +409,26 @@ static void initCompiler(Compiler* compiler, FunctionType type) {
     compiler->enclosing = current;
     compiler->function = NULL;
     compiler->type = type;
+    compiler->locals = NULL;
     compiler->localCount = 0;
+    compiler->localCapacity = 0;
+    compiler->upvalues = NULL;
+    compiler->upvalueCapacity = 0;
     compiler->scopeDepth = 0;
+    compiler->longJumps = false;
+    compiler->jumpOverflow = false;
+    compiler->registerResult = -1;
+    compiler->constantExprCount = 0;
     compiler->function = newFunction();
     current = compiler;
     if (type != TYPE_SCRIPT) {
         current->function->name = copyString(parser.previous.start,
                                              parser.previous.length);
+        writeBarrier((Obj*)current->function,
+                     OBJ_VAL(current->function->name));
     }
 
-    Local* local = &current->locals[current->localCount++];
+    Local* local = appendLocal(current);
     local->depth = 0;
     local->isCaptured = false;
     if (type != TYPE_FUNCTION) {
@@ -253,12 +443,100 @@ static void initCompiler(Compiler* compiler, FunctionType type) {
 }
 
 //static void endCompiler() {
+static bool isOp(Chunk* chunk, int offset, OpCode op) {
+    return offset < chunk->count && chunk->code[offset] == op;
+}
+
+static bool isNumberConstant(Chunk* chunk, int offset) {
+    return isOp(chunk, offset, OP_CONSTANT) &&
+           IS_NUMBER(chunk->constants.values[chunk->code[offset + 1]]);
+}
+
+// True if no jump lands strictly inside [start, start + length).
+static bool canFuse(bool* targets, int start, int length) {
+    for (int i = start + 1; i < start + length; i++) {
+        if (targets[i]) return false;
+    }
+    return true;
+}
+
+/*
+ * Peephole pass over a finished chunk. It overwrites the first opcode of a
+ * few sequences that dominate hot loops with a superinstruction that does the
+ * whole sequence in one dispatch. Operands stay where they are and the handler
+ * skips past the rest, so no offsets move and no jumps need patching. That
+ * also lets a handler bail out to the original sequence when its fast path
+ * doesn't apply.
+ */
+static void fuseInstructions(Chunk* chunk) {
+    bool* targets = ALLOCATE(bool, chunk->count + 1);
+    memset(targets, 0, chunk->count + 1);
+    for (int offset = 0; offset < chunk->count;
+         offset += instructionLength(chunk, offset)) {
+        uint8_t* code = &chunk->code[offset];
+        switch (code[0]) {
+            case OP_JUMP:
+            case OP_JUMP_IF_FALSE:
+                targets[offset + 3 + ((code[1] << 8) | code[2])] = true;
+                break;
+            case OP_LOOP:
+                targets[offset + 3 - ((code[1] << 8) | code[2])] = true;
+                break;
+            case OP_JUMP_LONG:
+            case OP_JUMP_IF_FALSE_LONG:
+                targets[offset + 4 +
+                        ((code[1] << 16) | (code[2] << 8) | code[3])] = true;
+                break;
+            case OP_LOOP_LONG:
+                targets[offset + 4 -
+                        ((code[1] << 16) | (code[2] << 8) | code[3])] = true;
+                break;
+        }
+    }
+
+    for (int offset = 0; offset < chunk->count;
+         offset += instructionLength(chunk, offset)) {
+        uint8_t* code = &chunk->code[offset];
+        if (code[0] == OP_GET_LOCAL) {
+            if (isOp(chunk, offset + 2, OP_GET_LOCAL) &&
+                isOp(chunk, offset + 4, OP_ADD) &&
+                canFuse(targets, offset, 5)) {
+                code[0] = OP_ADD_LOCALS;
+            } else if (isNumberConstant(chunk, offset + 2) &&
+                       isOp(chunk, offset + 4, OP_ADD) &&
+                       canFuse(targets, offset, 5)) {
+                code[0] = OP_ADD_LOCAL_CONSTANT;
+            } else if (isNumberConstant(chunk, offset + 2) &&
+                       (isOp(chunk, offset + 4, OP_LESS) ||
+                        isOp(chunk, offset + 4, OP_GREATER)) &&
+                       isOp(chunk, offset + 5, OP_JUMP_IF_FALSE) &&
+                       canFuse(targets, offset, 8)) {
+                code[0] = code[4] == OP_LESS
+                        ? OP_LESS_LOCAL_CONSTANT_JUMP
+                        : OP_GREATER_LOCAL_CONSTANT_JUMP;
+            } else if (isOp(chunk, offset + 2, OP_GET_PROPERTY) &&
+                       canFuse(targets, offset, 6)) {
+                code[0] = OP_GET_LOCAL_PROPERTY;
+            }
+        } else if (code[0] == OP_SET_LOCAL &&
+                   isOp(chunk, offset + 2, OP_POP) &&
+                   canFuse(targets, offset, 3)) {
+            code[0] = OP_SET_LOCAL_POP;
+        }
+    }
+
+    FREE_ARRAY(bool, targets, chunk->count + 1);
+}
+
 static ObjFunction* endCompiler() {
     emitReturn();
     ObjFunction* function = current->function;
+    // Code with overflowed jumps is about to be thrown away.
+    bool isFinal = !parser.hadError && !current->jumpOverflow;
+    if (isFinal) fuseInstructions(currentChunk());
 
 #ifdef DEBUG_PRINT_CODE
-    if (!parser.hadError) {
+    if (isFinal) {
 //        disassembleChunk(currentChunk(), "code");
         disassembleChunk(currentChunk(), function->name != NULL
                          ? function->name->chars : "<script>");
@@ -270,6 +548,12 @@ static ObjFunction* endCompiler() {
     return function;
 }
 
+// Frees what endCompiler() leaves behind for the caller to read.
+static void freeCompiler(Compiler* compiler) {
+    FREE_ARRAY(Local, compiler->locals, compiler->localCapacity);
+    FREE_ARRAY(Upvalue, compiler->upvalues, compiler->upvalueCapacity);
+}
+
 static void beginScope() {
     current->scopeDepth++;
 }
@@ -300,9 +584,54 @@ static void declaration();
 static ParseRule* getRule(TokenType type);
 static void parsePrecedence(Precedence precedence);
 
-static uint8_t identifierConstant(Token* name) {
-    return makeConstant(OBJ_VAL(copyString(name->start,
-                                           name->length)));
+/*
+ * Dead code still has to be parsed, and reported on, so these compile it
+ * normally and then drop everything it emitted: code, constants and inline
+ * caches alike. Nothing outside the dropped code refers to any of it.
+ */
+static void skipExpression(Precedence precedence) {
+    Chunk* chunk = currentChunk();
+    int start = chunk->count;
+    int constants = chunk->constants.count;
+    int caches = chunk->cacheCount;
+
+    parsePrecedence(precedence);
+
+    truncateCode(start);
+    chunk->constants.count = constants;
+    chunk->cacheCount = caches;
+}
+
+static void skipStatement() {
+    Chunk* chunk = currentChunk();
+    int start = chunk->count;
+    int constants = chunk->constants.count;
+    int caches = chunk->cacheCount;
+
+    statement();
+
+    truncateCode(start);
+    chunk->constants.count = constants;
+    chunk->cacheCount = caches;
+}
+
+// Names are table keys, so they're interned however long they are.
+static ObjString* identifierName(Token* name) {
+    return internString(copyString(name->start, name->length));
+}
+
+static int identifierConstant(Token* name) {
+    return makeConstant(OBJ_VAL(identifierName(name)));
+}
+
+// Globals are addressed by slot, not by a name constant. See globalSlot().
+static int resolveGlobal(Token* name) {
+    int slot = globalSlot(identifierName(name));
+    if (slot > UINT24_MAX) {
+        error("Too many global variables.");
+        return 0;
+    }
+    return slot;
 }
 
 static bool identifiersEqual(Token* a, Token* b) {
@@ -333,7 +662,7 @@ static int resolveLocal(Compiler* compiler, Token* name) {
 }
 
 // helper function for resolveUpvalue()
-static int addUpvalue(Compiler* compiler, uint8_t index,
+static int addUpvalue(Compiler* compiler, uint16_t index,
                       bool isLocal) {
     int upvalueCount = compiler->function->upvalueCount;
 
@@ -344,11 +673,19 @@ static int addUpvalue(Compiler* compiler, uint8_t index,
         }
     }
 
-    if (upvalueCount == UINT8_COUNT) {
+    if (upvalueCount == UINT16_COUNT) {
         error("Too many closure variables in function.");
         return 0;
     }
 
+    if (upvalueCount == compiler->upvalueCapacity) {
+        int oldCapacity = compiler->upvalueCapacity;
+        compiler->upvalueCapacity = GROW_CAPACITY(oldCapacity);
+        compiler->upvalues = GROW_ARRAY(Upvalue, compiler->upvalues,
+                                        oldCapacity,
+                                        compiler->upvalueCapacity);
+    }
+
     compiler->upvalues[upvalueCount].isLocal = isLocal;
     compiler->upvalues[upvalueCount].index = index;
     return compiler->function->upvalueCount++;
@@ -360,26 +697,26 @@ static int resolveUpvalue(Compiler* compiler, Token* name) {
 
     int local = resolveLocal(compiler->enclosing, name);
     if (local != -1) {
-        return addUpvalue(compiler, (uint8_t)local, true);
+        compiler->enclosing->locals[local].isCaptured = true;
+        return addUpvalue(compiler, (uint16_t)local, true);
     }
 
     // this recursive way is porting from Lua
     int upvalue = resolveUpvalue(compiler->enclosing, name);
     if (upvalue != -1) {
-        compiler->enclosing->locals[local].isCaptured = true;
-        return addUpvalue(compiler, (uint8_t)upvalue, false);
+        return addUpvalue(compiler, (uint16_t)upvalue, false);
     }
 
     return -1;
 }
 
 static void addLocal(Token name) {
-    if (current->localCount == UINT8_COUNT) {
+    if (current->localCount == UINT16_COUNT) {
         error("Too many local variables in function.");
         return;
     }
 
-    Local* local = &current->locals[current->localCount++];
+    Local* local = appendLocal(current);
     local->name = name;
 //    local->depth = current->scopeDepth;
     local->depth = -1;
@@ -405,13 +742,13 @@ static void declareVariable() {
     addLocal(*name);
 }
 
-static uint8_t parseVariable(const char* errorMessage) {
+static int parseVariable(const char* errorMessage) {
     consume(TOKEN_IDENTIFIER, errorMessage);
 
     declareVariable();
     if (current->scopeDepth > 0) return 0;
 
-    return identifierConstant(&parser.previous);
+    return resolveGlobal(&parser.previous);
 }
 
 static void markInitialized() {
@@ -420,13 +757,19 @@ static void markInitialized() {
         current->scopeDepth;
 }
 
-static void defineVariable(uint8_t global) {
+static void defineVariable(int global) {
     if (current->scopeDepth > 0) {
         markInitialized();
         return;
     }
 
-    emitBytes(OP_DEFINE_GLOBAL, global);
+    if (global <= UINT16_MAX) {
+        emitByte(OP_DEFINE_GLOBAL);
+        emitOperand(global, 2);
+    } else {
+        emitByte(OP_DEFINE_GLOBAL_LONG);
+        emitOperand(global, 3);
+    }
 }
 
 // a helper function argumentList() for call() helper func
@@ -446,7 +789,19 @@ static uint8_t argumentList() {
 }
 
 static void and_(bool canAssign) {
-    int endJump = emitJump(OP_JUMP_IF_FALSE);
+    ConstantExpr* left = lastConstant();
+    if (left != NULL) {
+        // A falsey left operand is the result and the right one never runs.
+        if (isFalseyConstant(left->value)) {
+            skipExpression(PREC_AND);
+        } else {
+            dropConstant();
+            parsePrecedence(PREC_AND);
+        }
+        return;
+    }
+
+    int endJump = emitJump(OP_JUMP_IF_FALSE, OP_JUMP_IF_FALSE_LONG);
 
     emitByte(OP_POP);
     parsePrecedence(PREC_AND);
@@ -454,12 +809,70 @@ static void and_(bool canAssign) {
     patchJump(endJump);
 }
 
+/*
+ * Folds `left op right` when both operands are constant expressions that
+ * end the chunk back to back. Operand types the instruction would reject at
+ * runtime are left alone so the error still happens, and at the same line.
+ */
+static bool foldBinary(TokenType operatorType, int rightStart) {
+    if (current->constantExprCount < 2) return false;
+
+    ConstantExpr* right = constantFrom(rightStart);
+    if (right == NULL) return false;
+    ConstantExpr* left = right - 1;
+    if (left->end != rightStart) return false;
+
+    Value a = left->value;
+    Value b = right->value;
+    Value result;
+    if (operatorType == TOKEN_EQUAL_EQUAL) {
+        result = BOOL_VAL(valuesEqual(a, b));
+    } else if (operatorType == TOKEN_BANG_EQUAL) {
+        result = BOOL_VAL(!valuesEqual(a, b));
+    } else if (operatorType == TOKEN_PLUS && IS_STRING(a) && IS_STRING(b)) {
+        ObjString* first = AS_STRING(a);
+        ObjString* second = AS_STRING(b);
+        int length = first->length + second->length;
+        char* chars = ALLOCATE(char, length + 1);
+        memcpy(chars, first->chars, first->length);
+        memcpy(chars + first->length, second->chars, second->length);
+        chars[length] = '\0';
+        result = OBJ_VAL(takeString(chars, length));
+    } else if (IS_NUMBER(a) && IS_NUMBER(b)) {
+        double x = AS_NUMBER(a);
+        double y = AS_NUMBER(b);
+        // >= and <= mirror the NOT the VM would run, NaNs included.
+        switch (operatorType) {
+            case TOKEN_GREATER:       result = BOOL_VAL(x > y); break;
+            case TOKEN_GREATER_EQUAL: result = BOOL_VAL(!(x < y)); break;
+            case TOKEN_LESS:          result = BOOL_VAL(x < y); break;
+            case TOKEN_LESS_EQUAL:    result = BOOL_VAL(!(x > y)); break;
+            case TOKEN_PLUS:          result = NUMBER_VAL(x + y); break;
+            case TOKEN_MINUS:         result = NUMBER_VAL(x - y); break;
+            case TOKEN_STAR:          result = NUMBER_VAL(x * y); break;
+            case TOKEN_SLASH:         result = NUMBER_VAL(x / y); break;
+            default: return false;
+        }
+    } else {
+        return false;
+    }
+
+    // Drop the right operand first so each gives back its own constant.
+    dropConstant();
+    dropConstant();
+    emitFolded(result);
+    return true;
+}
+
 //static void binary() {
 static void binary(bool canAssign) {
     TokenType operatorType = parser.previous.type;
     ParseRule* rule = getRule(operatorType);
+    int rightStart = currentChunk()->count;
     parsePrecedence((Precedence)(rule->precedence + 1));
 
+    if (foldBinary(operatorType, rightStart)) return;
+
     switch (operatorType) {
         case TOKEN_BANG_EQUAL:    emitBytes(OP_EQUAL, OP_NOT); break;
         case TOKEN_EQUAL_EQUAL:   emitByte(OP_EQUAL); break;
@@ -483,26 +896,25 @@ static void call(bool canAssign) {
 
 static void dot(bool canAssign) {
     consume(TOKEN_IDENTIFIER, "Expect property name after '.'.");
-    uint8_t name = identifierConstant(&parser.previous);
+    int name = identifierConstant(&parser.previous);
 
     if (canAssign && match(TOKEN_EQUAL)) {
         expression();
-        emitBytes(OP_SET_PROPERTY, name);
+        emitPropertyOp(OP_SET_PROPERTY, OP_SET_PROPERTY_LONG, name, 0);
     } else if (match(TOKEN_LEFT_PAREN)) {
         uint8_t argCount = argumentList();
-        emitBytes(OP_INVOKE, name);
-        emitByte(argCount);
+        emitPropertyOp(OP_INVOKE, OP_INVOKE_LONG, name, argCount);
     } else {
-        emitBytes(OP_GET_PROPERTY, name);
+        emitPropertyOp(OP_GET_PROPERTY, OP_GET_PROPERTY_LONG, name, 0);
     }
 }
 
 //static void literal() {
 static void literal(bool canAssign) {
     switch (parser.previous.type) {
-        case TOKEN_FALSE: emitByte(OP_FALSE); break;
-        case TOKEN_NIL: emitByte(OP_NIL); break;
-        case TOKEN_TRUE: emitByte(OP_TRUE); break;
+        case TOKEN_FALSE: emitLiteral(OP_FALSE, BOOL_VAL(false)); break;
+        case TOKEN_NIL: emitLiteral(OP_NIL, NIL_VAL); break;
+        case TOKEN_TRUE: emitLiteral(OP_TRUE, BOOL_VAL(true)); break;
     }
 }
 
@@ -533,9 +945,10 @@ static void block() {
     consume(TOKEN_RIGHT_BRACE, "Expect '}' after block.");
 }
 
-static void function(FunctionType type) {
-    Compiler compiler;
-    initCompiler(&compiler, type);
+static ObjFunction* functionBody(Compiler* compiler, FunctionType type,
+                                 bool longJumps) {
+    initCompiler(compiler, type);
+    compiler->longJumps = longJumps;
     beginScope();
 
     consume(TOKEN_LEFT_PAREN, "Expect '(' after function name.");
@@ -545,7 +958,7 @@ static void function(FunctionType type) {
             if (current->function->arity > 255) {
                 errorAtCurrent("Can't have more than 255 parameters.");
             }
-            uint8_t constant = parseVariable("Expect parameter namp.");
+            int constant = parseVariable("Expect parameter namp.");
             defineVariable(constant);
         } while (match(TOKEN_COMMA));
     }
@@ -553,19 +966,42 @@ static void function(FunctionType type) {
     consume(TOKEN_LEFT_BRACE, "Expect '{' before function body.");
     block();
 
-    ObjFunction* function = endCompiler();
+    return endCompiler();
+}
+
+/*
+ * Nearly every function fits its jumps in 16 bits, and we only find out it
+ * doesn't when a jump is patched, long after the code around it was
+ * emitted. So rather than widen every jump, such a function is compiled a
+ * second time from the same point in the source, with long jumps throughout.
+ */
+static void function(FunctionType type) {
+    Parser start = parser;
+    Scanner scanner = saveScanner();
+
+    Compiler compiler;
+    ObjFunction* function = functionBody(&compiler, type, false);
+    if (compiler.jumpOverflow && !parser.hadError) {
+        freeCompiler(&compiler);
+        parser = start;
+        restoreScanner(scanner);
+        function = functionBody(&compiler, type, true);
+    }
+
 //    emitBytes(OP_CONSTANT, makeConstant(OBJ_VAL(function)));
-    emitBytes(OP_CLOSURE, makeConstant(OBJ_VAL(function)));
+    emitConstantOp(OP_CLOSURE, OP_CLOSURE_LONG,
+                   makeConstant(OBJ_VAL(function)));
 
     for (int i = 0; i < function->upvalueCount; i++) {
         emitByte(compiler.upvalues[i].isLocal? 1 : 0);
-        emitByte(compiler.upvalues[i].index);
+        emitOperand(compiler.upvalues[i].index, 2);
     }
+    freeCompiler(&compiler);
 }
 
 static void method() {
     consume(TOKEN_IDENTIFIER, "Expect method name.");
-    uint8_t constant = identifierConstant(&parser.previous);
+    int constant = identifierConstant(&parser.previous);
 
 //    FunctionType type = TYPE_FUNCTION;
     FunctionType type = TYPE_METHOD;
@@ -576,7 +1012,7 @@ static void method() {
 
     function(type);
 
-    emitBytes(OP_METHOD, constant);
+    emitConstantOp(OP_METHOD, OP_METHOD_LONG, constant);
 }
 
 // this is function that defined at line 801
@@ -599,7 +1035,7 @@ static void super_(bool canAssign) {
 
     consume(TOKEN_DOT, "Expect '.' after 'super'.");
     consume(TOKEN_IDENTIFIER, "Expect superclass method name.");
-    uint8_t name = identifierConstant(&parser.previous);
+    int name = identifierConstant(&parser.previous);
 
     namedVariable(syntheticToken("this"), false);
 //    namedVariable(syntheticToken("super"), false);
@@ -607,22 +1043,23 @@ static void super_(bool canAssign) {
     if (match(TOKEN_LEFT_PAREN)) {
         uint8_t argCount = argumentList();
         namedVariable(syntheticToken("super"), false);
-        emitBytes(OP_SUPER_INVOKE, name);
+        emitConstantOp(OP_SUPER_INVOKE, OP_SUPER_INVOKE_LONG, name);
         emitByte(argCount);
     } else {
         namedVariable(syntheticToken("super"), false);
-        emitBytes(OP_GET_SUPER, name);
+        emitConstantOp(OP_GET_SUPER, OP_GET_SUPER_LONG, name);
     }
 }
 
 static void classDeclaration() {
     consume(TOKEN_IDENTIFIER, "Expect class name.");
     Token className = parser.previous;
-    uint8_t nameConstant = identifierConstant(&parser.previous);
+    int nameConstant = identifierConstant(&parser.previous);
     declareVariable();
+    int global = current->scopeDepth > 0 ? 0 : resolveGlobal(&className);
 
-    emitBytes(OP_CLASS, nameConstant);
-    defineVariable(nameConstant);
+    emitConstantOp(OP_CLASS, OP_CLASS_LONG, nameConstant);
+    defineVariable(global);
 
     ClassCompiler classCompiler;
     classCompiler.hasSuperclass = false;
@@ -662,14 +1099,14 @@ static void classDeclaration() {
 }
 
 static void funDeclaration() {
-    uint8_t global = parseVariable("Except function name.");
+    int global = parseVariable("Except function name.");
     markInitialized();
     function(TYPE_FUNCTION);
     defineVariable(global);
 }
 
 static void varDeclaration() {
-    uint8_t global = parseVariable("Expect variable name.");
+    int global = parseVariable("Expect variable name.");
 
     if (match(TOKEN_EQUAL)) {
         expression();
@@ -682,16 +1119,29 @@ static void varDeclaration() {
     defineVariable(global);
 }
 
+// Discards the value of an expression evaluated for its side effects.
+static void popExpression() {
+#ifdef REGISTER_OPS
+    // A register assignment left nothing on the stack but the GET_LOCAL we
+    // added for its value, so drop that instead of emitting a POP.
+    if (current->registerResult == currentChunk()->count - 2) {
+        currentChunk()->count -= 2;
+        current->registerResult = -1;
+        return;
+    }
+#endif
+    emitByte(OP_POP);
+}
+
 static void expressionStatement() {
     expression();
     consume(TOKEN_SEMICOLON, "Expect ';' after expression.");
-    emitByte(OP_POP);
+    popExpression();
 }
 
 static void forStatement() {
     beginScope();
     consume(TOKEN_LEFT_PAREN, "Expect '(' after 'for'.");
-    consume(TOKEN_SEMICOLON, "Expect ';'.");
     if (match(TOKEN_SEMICOLON)) {
         // No initializer.
     } else if (match(TOKEN_VAR)) {
@@ -718,9 +1168,15 @@ static void forStatement() {
         expression();
         consume(TOKEN_SEMICOLON, "Expect ';' after loop condition.");
 
-        // Jump out of the loop if the condition is false.
-        exitJump = emitJump(OP_JUMP_IF_FALSE);
-        emitByte(OP_POP); // Condition
+        // A constant truthy condition is the same as none at all.
+        ConstantExpr* condition = constantFrom(loopStart);
+        if (condition != NULL && !isFalseyConstant(condition->value)) {
+            dropConstant();
+        } else {
+            // Jump out of the loop if the condition is false.
+            exitJump = emitJump(OP_JUMP_IF_FALSE, OP_JUMP_IF_FALSE_LONG);
+            emitByte(OP_POP); // Condition
+        }
     }
 //    consume(TOKEN_RIGHT_PAREN, "Expect ')' after for clauses.");
 
@@ -730,10 +1186,10 @@ static void forStatement() {
      * but it shouldn't execute yet.
      */
     if (!match(TOKEN_RIGHT_PAREN)) {
-        int bodyJump = emitJump(OP_JUMP);
+        int bodyJump = emitJump(OP_JUMP, OP_JUMP_LONG);
         int incrementStart = currentChunk()->count;
         expression();
-        emitByte(OP_POP);
+        popExpression();
         consume(TOKEN_RIGHT_PAREN, "Expect ')' after for clause.");
 
         emitLoop(loopStart);
@@ -753,14 +1209,30 @@ static void forStatement() {
 
 static void ifStatement() {
     consume(TOKEN_LEFT_PAREN, "Except '(' after 'if'.");
+    int conditionStart = currentChunk()->count;
     expression();
     consume(TOKEN_RIGHT_PAREN, "Except ')' after condition.");
 
-    int thenJump = emitJump(OP_JUMP_IF_FALSE);
+    ConstantExpr* condition = constantFrom(conditionStart);
+    if (condition != NULL) {
+        // Only the branch that can run is kept, without any jumps.
+        bool isFalsey = isFalseyConstant(condition->value);
+        dropConstant();
+        if (isFalsey) {
+            skipStatement();
+            if (match(TOKEN_ELSE)) statement();
+        } else {
+            statement();
+            if (match(TOKEN_ELSE)) skipStatement();
+        }
+        return;
+    }
+
+    int thenJump = emitJump(OP_JUMP_IF_FALSE, OP_JUMP_IF_FALSE_LONG);
     emitByte(OP_POP);
     statement();
 
-    int elseJump = emitJump(OP_JUMP);
+    int elseJump = emitJump(OP_JUMP, OP_JUMP_LONG);
 
     patchJump(thenJump);
     emitByte(OP_POP);
@@ -801,7 +1273,21 @@ static void whileStatement() {
     expression();
     consume(TOKEN_RIGHT_PAREN, "Expect ')' after condition.");
 
-    int exitJump = emitJump(OP_JUMP_IF_FALSE);
+    ConstantExpr* condition = constantFrom(loopStart);
+    if (condition != NULL) {
+        // `while (false)` never runs; `while (true)` needs no exit test.
+        bool isFalsey = isFalseyConstant(condition->value);
+        dropConstant();
+        if (isFalsey) {
+            skipStatement();
+        } else {
+            statement();
+            emitLoop(loopStart);
+        }
+        return;
+    }
+
+    int exitJump = emitJump(OP_JUMP_IF_FALSE, OP_JUMP_IF_FALSE_LONG);
     emitByte(OP_POP);
     statement();
     emitLoop(loopStart);
@@ -836,6 +1322,7 @@ static void synchronize() {
 
 static void declaration() {
 //    statement();
+    current->constantExprCount = 0;
     if (match(TOKEN_CLASS)) {
         classDeclaration();
     } else if (match(TOKEN_FUN)) {
@@ -850,6 +1337,7 @@ static void declaration() {
 }
 
 static void statement() {
+    current->constantExprCount = 0;
     if (match(TOKEN_PRINT)) {
         printStatement();
     } else if (match(TOKEN_FOR)) {
@@ -877,8 +1365,20 @@ static void number(bool canAssign) {
 }
 
 static void or_(bool canAssign) {
-    int elseJump = emitJump(OP_JUMP_IF_FALSE);
-    int endJump = emitJump(OP_JUMP);
+    ConstantExpr* left = lastConstant();
+    if (left != NULL) {
+        // A truthy left operand is the result and the right one never runs.
+        if (isFalseyConstant(left->value)) {
+            dropConstant();
+            parsePrecedence(PREC_OR);
+        } else {
+            skipExpression(PREC_OR);
+        }
+        return;
+    }
+
+    int elseJump = emitJump(OP_JUMP_IF_FALSE, OP_JUMP_IF_FALSE_LONG);
+    int endJump = emitJump(OP_JUMP, OP_JUMP_LONG);
 
     patchJump(elseJump);
     emitByte(OP_POP);
@@ -893,6 +1393,45 @@ static void string(bool canAssign) {
                                     parser.previous.length - 2)));
 }
 
+#ifdef REGISTER_OPS
+/*
+ * The register backend. If the right-hand side of an assignment to a local
+ * compiled to exactly `GET_LOCAL a, GET_LOCAL b | CONSTANT b, <arith>`, it is
+ * rewritten into one three-address instruction that reads both operands
+ * straight from the frame and stores into the destination slot. A GET_LOCAL
+ * of the destination follows so the assignment still has a value; in
+ * statement position popExpression() takes it back out. Anything more
+ * involved stays on the stack.
+ */
+static bool emitRegisterAssign(int start, uint8_t dest) {
+    Chunk* chunk = currentChunk();
+    if (chunk->count - start != 5) return false;
+
+    uint8_t* code = &chunk->code[start];
+    if (code[0] != OP_GET_LOCAL) return false;
+    if (code[2] != OP_GET_LOCAL && code[2] != OP_CONSTANT) return false;
+    bool isConstant = code[2] == OP_CONSTANT;
+
+    OpCode op;
+    switch (code[4]) {
+        case OP_ADD:      op = isConstant ? OP_ADD_RK : OP_ADD_RR; break;
+        case OP_SUBTRACT: op = isConstant ? OP_SUBTRACT_RK : OP_SUBTRACT_RR; break;
+        case OP_MULTIPLY: op = isConstant ? OP_MULTIPLY_RK : OP_MULTIPLY_RR; break;
+        case OP_DIVIDE:   op = isConstant ? OP_DIVIDE_RK : OP_DIVIDE_RR; break;
+        default: return false;
+    }
+
+    uint8_t a = code[1];
+    uint8_t b = code[3];
+    truncateCode(start);
+    emitBytes(op, dest);
+    emitBytes(a, b);
+    current->registerResult = chunk->count;
+    emitBytes(OP_GET_LOCAL, dest);
+    return true;
+}
+#endif
+
 //static void namedVariable(Token name) {
 static void namedVariable(Token name, bool canAssign) {
 //    uint8_t arg = identifierConstant(&name);
@@ -900,27 +1439,42 @@ static void namedVariable(Token name, bool canAssign) {
 
 //    if (match(TOKEN_EQUAL)) {
     uint8_t getOp, setOp;
+    int width;  // of the operand
     int arg = resolveLocal(current, &name);
     if (arg != -1) {
-        getOp = OP_GET_LOCAL;
-        setOp = OP_SET_LOCAL;
+        bool isLong = arg > UINT8_MAX;
+        getOp = isLong ? OP_GET_LOCAL_LONG : OP_GET_LOCAL;
+        setOp = isLong ? OP_SET_LOCAL_LONG : OP_SET_LOCAL;
+        width = isLong ? 2 : 1;
     } else if ((arg = resolveUpvalue(current, &name)) != -1) {
-        getOp = OP_GET_UPVALUE;
-        setOp = OP_SET_UPVALUE;
+        bool isLong = arg > UINT8_MAX;
+        getOp = isLong ? OP_GET_UPVALUE_LONG : OP_GET_UPVALUE;
+        setOp = isLong ? OP_SET_UPVALUE_LONG : OP_SET_UPVALUE;
+        width = isLong ? 2 : 1;
     } else {
-        arg = identifierConstant(&name);
-        getOp = OP_GET_GLOBAL;
-        setOp = OP_SET_GLOBAL;
+        arg = resolveGlobal(&name);
+        bool isLong = arg > UINT16_MAX;
+        getOp = isLong ? OP_GET_GLOBAL_LONG : OP_GET_GLOBAL;
+        setOp = isLong ? OP_SET_GLOBAL_LONG : OP_SET_GLOBAL;
+        width = isLong ? 3 : 2;
     }
 
+    uint8_t op = getOp;
     if (canAssign && match(TOKEN_EQUAL)) {
+#ifdef REGISTER_OPS
+        int start = currentChunk()->count;
+#endif
         expression();
-//        emitBytes(OP_SET_GLOBAL, arg);
-        emitBytes(setOp, (uint8_t)arg);
-    } else {
-//        emitBytes(OP_GET_GLOBAL, arg);
-        emitBytes(getOp, (uint8_t)arg);
+        op = setOp;
+#ifdef REGISTER_OPS
+        if (op == OP_SET_LOCAL && emitRegisterAssign(start, (uint8_t)arg)) {
+            return;
+        }
+#endif
     }
+
+    emitByte(op);
+    emitOperand(arg, width);
 }
 
 //static void variable() {
@@ -945,8 +1499,24 @@ static void unary(bool canAssign) {
 
     // Compile the operand
 //    expression();
+    int start = currentChunk()->count;
     parsePrecedence(PREC_UNARY);
 
+    ConstantExpr* operand = constantFrom(start);
+    if (operand != NULL) {
+        Value value = operand->value;
+        if (operatorType == TOKEN_BANG) {
+            dropConstant();
+            emitFolded(BOOL_VAL(isFalseyConstant(value)));
+            return;
+        }
+        if (operatorType == TOKEN_MINUS && IS_NUMBER(value)) {
+            dropConstant();
+            emitFolded(NUMBER_VAL(-AS_NUMBER(value)));
+            return;
+        }
+    }
+
     // Emit the operator instruction
     switch (operatorType) {
         case TOKEN_BANG: emitByte(OP_NOT); break;
@@ -1048,7 +1618,8 @@ static ParseRule* getRule(TokenType type) {
 
 //void compile(const char* source) {
 //bool compile(const char* source, Chunk* chunk) {
-ObjFunction* compile(const char* source) {
+static ObjFunction* script(Compiler* compiler, const char* source,
+                           bool longJumps) {
     initScanner(source);
 //    int line = -1;
 //    for (;;) {
@@ -1063,10 +1634,10 @@ ObjFunction* compile(const char* source) {
 //
 //        if (token.type == TOKEN_EOF) break;
 //    }
-    Compiler compiler;
 //    initCompiler(&compiler);
 //    compilingChunk = chunk;
-    initCompiler(&compiler, TYPE_SCRIPT);
+    initCompiler(compiler, TYPE_SCRIPT);
+    compiler->longJumps = longJumps;
 
     parser.hadError = false;
     parser.panicMode = false;
@@ -1080,11 +1651,27 @@ ObjFunction* compile(const char* source) {
     }
 
 //    endCompiler();
-    ObjFunction* function = endCompiler();
+    return endCompiler();
+}
+
+ObjFunction* compile(const char* source) {
+    // Like a function, the script is compiled again if its jumps overflow.
+    Compiler compiler;
+    ObjFunction* function = script(&compiler, source, false);
+    if (compiler.jumpOverflow && !parser.hadError) {
+        freeCompiler(&compiler);
+        function = script(&compiler, source, true);
+    }
+    freeCompiler(&compiler);
 //    return !parser.hadError;
     return parser.hadError ? NULL : function;
 }
 
+void abandonCompile() {
+    current = NULL;
+    currentClass = NULL;
+}
+
 void markCompilerRoots() {
     Compiler* compiler = current;
     while (compiler != NULL) {
@@ -6,6 +6,7 @@
 #include "debug.h"
 #include "object.h"
 #include "value.h"
+#include "vm.h"
 
 void disassembleChunk(Chunk* chunk, const char* name) {
     printf("== %s ==\n", name);
@@ -15,6 +16,15 @@ void disassembleChunk(Chunk* chunk, const char* name) {
     }
 }
 
+// Reads a big-endian operand `width` bytes wide.
+static int readOperand(Chunk* chunk, int offset, int width) {
+    int operand = 0;
+    for (int i = 0; i < width; i++) {
+        operand = (operand << 8) | chunk->code[offset + i];
+    }
+    return operand;
+}
+
 static int constantInstruction(const char* name, Chunk* chunk,
                                int offset) {
     uint8_t constant = chunk->code[offset + 1];
@@ -28,13 +38,121 @@ static int constantInstruction(const char* name, Chunk* chunk,
                         // OP_CONSTANT is two - one for the opcode and one for operand
 }
 
-static int invokeInstruction(const char* name, Chunk* chunk, int offset) {
-    uint8_t constant = chunk->code[offset + 1];
-    uint8_t argCount = chunk->code[offset + 2];
+static int constantLongInstruction(const char* name, Chunk* chunk,
+                                   int offset) {
+    int constant = readOperand(chunk, offset + 1, 3);
+    printf("%-16s %4d '", name, constant);
+    printValue(chunk->constants.values[constant]);
+    printf("'\n");
+    return offset + 4;
+}
+
+/*
+ * The long forms of the instructions below widen the constant (and cache)
+ * index from one byte (and two) to three each; `width` is the width of the
+ * constant index.
+ */
+static int invokeInstruction(const char* name, Chunk* chunk, int offset,
+                             int width) {
+    int constant = readOperand(chunk, offset + 1, width);
+    uint8_t argCount = chunk->code[offset + 1 + width];
     printf("%-16s (%d args) %4d '", name, argCount, constant);
     printValue(chunk->constants.values[constant]);
     printf("'\n");
-    return offset + 3;
+    return offset + 2 + width;
+}
+
+static int cacheInstruction(const char* name, Chunk* chunk, int offset,
+                            int width) {
+    int constant = readOperand(chunk, offset + 1, width);
+    int cacheWidth = width == 1 ? 2 : 3;
+    int cache = readOperand(chunk, offset + 1 + width, cacheWidth);
+    printf("%-16s %4d '", name, constant);
+    printValue(chunk->constants.values[constant]);
+    printf("' [cache %d]\n", cache);
+    return offset + 1 + width + cacheWidth;
+}
+
+static int invokeCacheInstruction(const char* name, Chunk* chunk,
+                                  int offset, int width) {
+    int constant = readOperand(chunk, offset + 1, width);
+    uint8_t argCount = chunk->code[offset + 1 + width];
+    int cacheWidth = width == 1 ? 2 : 3;
+    int cache = readOperand(chunk, offset + 2 + width, cacheWidth);
+    printf("%-16s (%d args) %4d '", name, argCount, constant);
+    printValue(chunk->constants.values[constant]);
+    printf("' [cache %d]\n", cache);
+    return offset + 2 + width + cacheWidth;
+}
+
+static int globalInstruction(const char* name, Chunk* chunk, int offset,
+                             int width) {
+    int slot = readOperand(chunk, offset + 1, width);
+    printf("%-16s %4d '", name, slot);
+    printValue(vm.globalNames.values[slot]);
+    printf("'\n");
+    return offset + 1 + width;
+}
+
+/*
+ * A superinstruction is printed as one line, with the operands of the
+ * sequence it replaced, and skips over the whole sequence.
+ */
+static int localsInstruction(const char* name, Chunk* chunk, int offset) {
+    printf("%-16s %4d %4d\n", name, chunk->code[offset + 1],
+           chunk->code[offset + 3]);
+    return offset + 5;
+}
+
+static int localConstantInstruction(const char* name, Chunk* chunk,
+                                    int offset) {
+    uint8_t slot = chunk->code[offset + 1];
+    uint8_t constant = chunk->code[offset + 3];
+    printf("%-16s %4d %4d '", name, slot, constant);
+    printValue(chunk->constants.values[constant]);
+    printf("'\n");
+    return offset + 5;
+}
+
+static int localConstantJumpInstruction(const char* name, Chunk* chunk,
+                                        int offset) {
+    uint8_t slot = chunk->code[offset + 1];
+    uint8_t constant = chunk->code[offset + 3];
+    uint16_t jump = (uint16_t)(chunk->code[offset + 6] << 8);
+    jump |= chunk->code[offset + 7];
+    printf("%-16s %4d %4d '", name, slot, constant);
+    printValue(chunk->constants.values[constant]);
+    printf("' -> %d\n", offset + 8 + jump);
+    return offset + 8;
+}
+
+static int localPropertyInstruction(const char* name, Chunk* chunk,
+                                    int offset) {
+    uint8_t slot = chunk->code[offset + 1];
+    uint8_t constant = chunk->code[offset + 3];
+    uint16_t cache = (uint16_t)(chunk->code[offset + 4] << 8);
+    cache |= chunk->code[offset + 5];
+    printf("%-16s %4d %4d '", name, slot, constant);
+    printValue(chunk->constants.values[constant]);
+    printf("' [cache %d]\n", cache);
+    return offset + 6;
+}
+
+static int registerInstruction(const char* name, Chunk* chunk,
+                               int offset) {
+    printf("%-16s %4d %4d %4d\n", name, chunk->code[offset + 1],
+           chunk->code[offset + 2], chunk->code[offset + 3]);
+    return offset + 4;
+}
+
+static int registerConstantInstruction(const char* name, Chunk* chunk,
+                                       int offset) {
+    uint8_t constant = chunk->code[offset + 3];
+    printf("%-16s %4d %4d %4d '", name, chunk->code[offset + 1],
+           chunk->code[offset + 2], constant);
+    printValue(chunk->constants.values[constant]);
+    printf("'\n");
+    return offset + 4;
 }
 
 static int simpleInstruction(const char* name, int offset) {
@@ -55,13 +173,38 @@ static int byteInstruction(const char* name, Chunk* chunk, int offset) {
     return offset + 2;
 }
 
+// The long forms of local and upvalue instructions take a 16-bit slot.
+static int shortInstruction(const char* name, Chunk* chunk, int offset) {
+    int slot = readOperand(chunk, offset + 1, 2);
+    printf("%-16s %4d\n", name, slot);
+    return offset + 3;
+}
+
 static int jumpInstruction(const char* name, int sign,
-                           Chunk* chunk, int offset) {
-    uint16_t jump = (uint16_t)(chunk->code[offset + 1] << 8);
-    jump |= chunk->code[offset + 2];
+                           Chunk* chunk, int offset, int width) {
+    int jump = readOperand(chunk, offset + 1, width);
     printf("%-16s %4d -> %d\n", name, offset,
-           offset + 3 + sign * jump);
-    return offset + 3;
+           offset + 1 + width + sign * jump);
+    return offset + 1 + width;
+}
+
+static int closureInstruction(const char* name, Chunk* chunk, int offset,
+                              int width) {
+    int constant = readOperand(chunk, offset + 1, width);
+    offset += 1 + width;
+    printf("%-16s %4d ", name, constant);
+    printValue(chunk->constants.values[constant]);
+    printf("\n");
+
+    ObjFunction* function = AS_FUNCTION(chunk->constants.values[constant]);
+    for (int j = 0; j < function->upvalueCount; j++) {
+        int isLocal = chunk->code[offset];
+        int index = readOperand(chunk, offset + 1, 2);
+        printf("%04d      |                     %s %d\n",
+               offset, isLocal ? "local" : "upvalue", index);
+        offset += 3;
+    }
+    return offset;
 }
 
 int disassembleInstruction(Chunk* chunk, int offset) {
@@ -90,19 +233,19 @@ int disassembleInstruction(Chunk* chunk, int offset) {
         case OP_SET_LOCAL:
             return byteInstruction("OP_SET_LOCAL", chunk, offset);
         case OP_GET_GLOBAL:
-            return constantInstruction("OP_GET_GLOBAL", chunk, offset);
+            return globalInstruction("OP_GET_GLOBAL", chunk, offset, 2);
         case OP_DEFINE_GLOBAL:
-            return constantInstruction("OP_DEFINE_GLOBAL", chunk, offset);
+            return globalInstruction("OP_DEFINE_GLOBAL", chunk, offset, 2);
         case OP_SET_GLOBAL:
-            return constantInstruction("OP_SET_GLOBAL", chunk, offset);
+            return globalInstruction("OP_SET_GLOBAL", chunk, offset, 2);
         case OP_GET_UPVALUE:
             return byteInstruction("OP_GET_UPVALUE", chunk, offset);
         case OP_SET_UPVALUE:
             return byteInstruction("OP_SET_UPVALUE", chunk, offset);
         case OP_GET_PROPERTY:
-            return constantInstruction("OP_GET_PROPERTY", chunk, offset);
+            return cacheInstruction("OP_GET_PROPERTY", chunk, offset, 1);
         case OP_SET_PROPERTY:
-            return constantInstruction("OP_SET_PROPERTY", chunk, offset);
+            return cacheInstruction("OP_SET_PROPERTY", chunk, offset, 1);
         case OP_GET_SUPER:
             return constantInstruction("OP_GET_SUPER", chunk, offset);
         case OP_EQUAL:
@@ -126,34 +269,19 @@ int disassembleInstruction(Chunk* chunk, int offset) {
         case OP_PRINT:
             return simpleInstruction("OP_PRINT", offset);
         case OP_JUMP:
-            return jumpInstruction("OP_JUMP", 1, chunk, offset);
+            return jumpInstruction("OP_JUMP", 1, chunk, offset, 2);
         case OP_JUMP_IF_FALSE:
-            return jumpInstruction("OP_JUMP_IF_FALSE", 1, chunk, offset);
+            return jumpInstruction("OP_JUMP_IF_FALSE", 1, chunk, offset, 2);
         case OP_LOOP:
-            return jumpInstruction("OP_LOOP", -1, chunk, offset);
+            return jumpInstruction("OP_LOOP", -1, chunk, offset, 2);
         case OP_CALL:
             return byteInstruction("OP_CALL", chunk, offset);
         case OP_INVOKE:
-            return invokeInstruction("OP_INVOKE", chunk, offset);
+            return invokeCacheInstruction("OP_INVOKE", chunk, offset, 1);
         case OP_SUPER_INVOKE:
-            return invokeInstruction("OP_SUPER_INVOKE", chunk, offset);
-        case OP_CLOSURE: {
-            offset++;
-            uint8_t constant = chunk->code[offset++];
-            printf("%-16s %4d ", "OP_CLOSURE", constant);
-            printValue(chunk->constants.values[constant]);
-            printf("\n");
-
-            ObjFunction* function = AS_FUNCTION(
-                    chunk->constants.values[constant]);
-            for (int j = 0; j < function->upvalueCount; j++) {
-                int isLocal = chunk->code[offset++];
-                int index = chunk->code[offset++];
-                printf("%04d      |                     %s %d\n",
-                       offset - 2, isLocal ? "local" : "upvalue", index);
-            }
-            return offset;
-        }
+            return invokeInstruction("OP_SUPER_INVOKE", chunk, offset, 1);
+        case OP_CLOSURE:
+            return closureInstruction("OP_CLOSURE", chunk, offset, 1);
         case OP_CLOSE_UPVALUE:
             return simpleInstruction("OP_CLOSE_UPVALUE", offset);
         case OP_RETURN:
@@ -164,6 +292,76 @@ int disassembleInstruction(Chunk* chunk, int offset) {
             return simpleInstruction("OP_INHERIT", offset);
         case OP_METHOD:
             return constantInstruction("OP_METHOD", chunk, offset);
+        case OP_ADD_LOCALS:
+            return localsInstruction("OP_ADD_LOCALS", chunk, offset);
+        case OP_ADD_LOCAL_CONSTANT:
+            return localConstantInstruction("OP_ADD_LOCAL_CONSTANT", chunk,
+                                            offset);
+        case OP_LESS_LOCAL_CONSTANT_JUMP:
+            return localConstantJumpInstruction(
+                    "OP_LESS_LOCAL_CONSTANT_JUMP", chunk, offset);
+        case OP_GREATER_LOCAL_CONSTANT_JUMP:
+            return localConstantJumpInstruction(
+                    "OP_GREATER_LOCAL_CONSTANT_JUMP", chunk, offset);
+        case OP_GET_LOCAL_PROPERTY:
+            return localPropertyInstruction("OP_GET_LOCAL_PROPERTY", chunk,
+                                            offset);
+        case OP_SET_LOCAL_POP:
+            return byteInstruction("OP_SET_LOCAL_POP", chunk, offset) + 1;
+        case OP_ADD_RR:
+            return registerInstruction("OP_ADD_RR", chunk, offset);
+        case OP_SUBTRACT_RR:
+            return registerInstruction("OP_SUBTRACT_RR", chunk, offset);
+        case OP_MULTIPLY_RR:
+            return registerInstruction("OP_MULTIPLY_RR", chunk, offset);
+        case OP_DIVIDE_RR:
+            return registerInstruction("OP_DIVIDE_RR", chunk, offset);
+        case OP_ADD_RK:
+            return registerConstantInstruction("OP_ADD_RK", chunk, offset);
+        case OP_SUBTRACT_RK:
+            return registerConstantInstruction("OP_SUBTRACT_RK", chunk, offset);
+        case OP_MULTIPLY_RK:
+            return registerConstantInstruction("OP_MULTIPLY_RK", chunk, offset);
+        case OP_DIVIDE_RK:
+            return registerConstantInstruction("OP_DIVIDE_RK", chunk, offset);
+        case OP_CONSTANT_LONG:
+            return constantLongInstruction("OP_CONSTANT_LONG", chunk, offset);
+        case OP_GET_LOCAL_LONG:
+            return shortInstruction("OP_GET_LOCAL_LONG", chunk, offset);
+        case OP_SET_LOCAL_LONG:
+            return shortInstruction("OP_SET_LOCAL_LONG", chunk, offset);
+        case OP_GET_GLOBAL_LONG:
+            return globalInstruction("OP_GET_GLOBAL_LONG", chunk, offset, 3);
+        case OP_DEFINE_GLOBAL_LONG:
+            return globalInstruction("OP_DEFINE_GLOBAL_LONG", chunk, offset, 3);
+        case OP_SET_GLOBAL_LONG:
+            return globalInstruction("OP_SET_GLOBAL_LONG", chunk, offset, 3);
+        case OP_GET_UPVALUE_LONG:
+            return shortInstruction("OP_GET_UPVALUE_LONG", chunk, offset);
+        case OP_SET_UPVALUE_LONG:
+            return shortInstruction("OP_SET_UPVALUE_LONG", chunk, offset);
+        case OP_GET_PROPERTY_LONG:
+            return cacheInstruction("OP_GET_PROPERTY_LONG", chunk, offset, 3);
+        case OP_SET_PROPERTY_LONG:
+            return cacheInstruction("OP_SET_PROPERTY_LONG", chunk, offset, 3);
+        case OP_GET_SUPER_LONG:
+            return constantLongInstruction("OP_GET_SUPER_LONG", chunk, offset);
+        case OP_JUMP_LONG:
+            return jumpInstruction("OP_JUMP_LONG", 1, chunk, offset, 3);
+        case OP_JUMP_IF_FALSE_LONG:
+            return jumpInstruction("OP_JUMP_IF_FALSE_LONG", 1, chunk, offset, 3);
+        case OP_LOOP_LONG:
+            return jumpInstruction("OP_LOOP_LONG", -1, chunk, offset, 3);
+        case OP_INVOKE_LONG:
+            return invokeCacheInstruction("OP_INVOKE_LONG", chunk, offset, 3);
+        case OP_SUPER_INVOKE_LONG:
+            return invokeInstruction("OP_SUPER_INVOKE_LONG", chunk, offset, 3);
+        case OP_CLOSURE_LONG:
+            return closureInstruction("OP_CLOSURE_LONG", chunk, offset, 3);
+        case OP_CLASS_LONG:
+            return constantLongInstruction("OP_CLASS_LONG", chunk, offset);
+        case OP_METHOD_LONG:
+            return constantLongInstruction("OP_METHOD_LONG", chunk, offset);
         default:
             printf("Unknown opcode %d\n", instruction);
             return offset + 1;
@@ -0,0 +1,96 @@
+//
+// Created by aucker on 10/16/2026.
+//
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "gcpolicy.h"
+
+void initGCPolicy(GCPolicy* policy) {
+    policy->initialHeap = GC_INITIAL_HEAP;
+    policy->minHeap = GC_MIN_HEAP;
+    policy->maxHeap = 0;
+    policy->growFactor = GC_HEAP_GROW_FACTOR;
+    policy->targetGCPercent = 0;
+    policy->gcSeconds = 0;
+    policy->windowStart = gcClock();
+}
+
+static bool parseNumber(const char* text, double* number) {
+    char* end;
+    *number = strtod(text, &end);
+    return end != text && *end == '\0';
+}
+
+// A byte count, with an optional K, M or G suffix.
+static bool parseSize(const char* text, size_t* size) {
+    char* end;
+    double value = strtod(text, &end);
+    if (end == text || value < 0) return false;
+
+    switch (*end) {
+        case 'K': case 'k': value *= 1024; end++; break;
+        case 'M': case 'm': value *= 1024 * 1024; end++; break;
+        case 'G': case 'g': value *= 1024 * 1024 * 1024; end++; break;
+    }
+    if (*end != '\0') return false;
+
+    *size = (size_t)value;
+    return true;
+}
+
+bool parseGCOption(GCPolicy* policy, const char* option) {
+    const char* value = strchr(option, '=');
+    if (value == NULL) return false;
+    size_t length = value - option;
+    value++;
+
+#define OPTION(name) (length == strlen(name) && memcmp(option, name, length) == 0)
+    if (OPTION("--heap-initial")) return parseSize(value, &policy->initialHeap);
+    if (OPTION("--heap-min")) return parseSize(value, &policy->minHeap);
+    if (OPTION("--heap-max")) return parseSize(value, &policy->maxHeap);
+    if (OPTION("--heap-grow")) {
+        return parseNumber(value, &policy->growFactor) &&
+               policy->growFactor > 1;
+    }
+    if (OPTION("--gc-target")) {
+        return parseNumber(value, &policy->targetGCPercent) &&
+               policy->targetGCPercent >= 0 &&
+               policy->targetGCPercent < 100;
+    }
+#undef OPTION
+    return false;
+}
+
+/*
+ * Called at the end of a full collection, with what survived it, for
+ * where the next one should start.
+ */
+size_t nextGCThreshold(GCPolicy* policy, size_t liveBytes) {
+    if (policy->targetGCPercent > 0) {
+        double time = gcClock();
+        double elapsed = time - policy->windowStart;
+        if (elapsed > 0) {
+            double percent = 100 * policy->gcSeconds / elapsed;
+            // One bad cycle shouldn't swing the heap too far either way.
+            double error = percent / policy->targetGCPercent;
+            if (error < 0.5) error = 0.5;
+            if (error > 2) error = 2;
+
+            double factor = 1 + (policy->growFactor - 1) * error;
+            if (factor < GC_MIN_GROW_FACTOR) factor = GC_MIN_GROW_FACTOR;
+            if (factor > GC_MAX_GROW_FACTOR) factor = GC_MAX_GROW_FACTOR;
+            policy->growFactor = factor;
+        }
+        policy->gcSeconds = 0;
+        policy->windowStart = time;
+    }
+
+    size_t next = (size_t)(liveBytes * policy->growFactor);
+    if (next < policy->minHeap) next = policy->minHeap;
+    if (policy->maxHeap != 0 && next > policy->maxHeap) {
+        next = policy->maxHeap;
+    }
+    return next;
+}
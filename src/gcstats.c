@@ -0,0 +1,94 @@
+//
+// Created by aucker on 10/16/2026.
+//
+
+// For clock_gettime(), which isn't in C99.
+#define _DEFAULT_SOURCE
+
+#include <string.h>
+#include <time.h>
+
+#include "gcstats.h"
+
+static const char* typeNames[OBJ_TYPE_COUNT] = {
+        [OBJ_BOUND_METHOD] = "boundMethods",
+        [OBJ_CLASS] = "classes",
+        [OBJ_CLOSURE] = "closures",
+        [OBJ_FUNCTION] = "functions",
+        [OBJ_INSTANCE] = "instances",
+        [OBJ_NATIVE] = "natives",
+        [OBJ_SHAPE] = "shapes",
+        [OBJ_STRING] = "strings",
+        [OBJ_UPVALUE] = "upvalues",
+};
+
+static const char* bucketNames[GC_PAUSE_BUCKETS] = {
+        "< 10us", "< 100us", "< 1ms", "< 10ms", "< 100ms", ">= 100ms",
+};
+
+double gcClock() {
+#ifdef CLOCK_MONOTONIC
+    struct timespec time;
+    clock_gettime(CLOCK_MONOTONIC, &time);
+    return (double)time.tv_sec + (double)time.tv_nsec / 1e9;
+#else
+    return (double)clock() / CLOCKS_PER_SEC;
+#endif
+}
+
+void initGCStats(GCStats* stats) {
+    memset(stats, 0, sizeof(GCStats));
+}
+
+void beginGCPause(GCStats* stats) {
+    if (stats->pauseDepth++ == 0) stats->pauseStart = gcClock();
+}
+
+double endGCPause(GCStats* stats) {
+    if (--stats->pauseDepth != 0) return 0;
+
+    double pause = gcClock() - stats->pauseStart;
+    stats->pauses++;
+    stats->pauseSeconds += pause;
+    if (pause > stats->maxPauseSeconds) stats->maxPauseSeconds = pause;
+
+    int bucket = 0;
+    double limit = 1e-5;
+    while (bucket < GC_PAUSE_BUCKETS - 1 && pause >= limit) {
+        bucket++;
+        limit *= 10;
+    }
+    stats->pauseHistogram[bucket]++;
+    return pause;
+}
+
+const char* objectTypeName(ObjType type) {
+    return typeNames[type];
+}
+
+void printGCStats(GCStats* stats, FILE* file) {
+    fprintf(file, "-- gc stats\n");
+    fprintf(file, "   %zu young and %zu full collections, %zu compactions\n",
+            stats->youngCollections, stats->fullCollections,
+            stats->compactions);
+    fprintf(file, "   %zu pauses, %.3f ms in all, %.3f ms at most\n",
+            stats->pauses, stats->pauseSeconds * 1000,
+            stats->maxPauseSeconds * 1000);
+    for (int i = 0; i < GC_PAUSE_BUCKETS; i++) {
+        fprintf(file, "   %9s %zu\n", bucketNames[i],
+                stats->pauseHistogram[i]);
+    }
+    fprintf(file, "   %zu bytes allocated, %zu freed\n",
+            stats->bytesAllocated, stats->bytesFreed);
+
+    fprintf(file, "   %-12s %10s %10s %10s %12s %12s\n", "type", "allocated",
+            "freed", "live", "bytes", "bytes freed");
+    for (int type = 0; type < OBJ_TYPE_COUNT; type++) {
+        fprintf(file, "   %-12s %10zu %10zu %10zu %12zu %12zu\n",
+                typeNames[type], stats->objectsAllocated[type],
+                stats->objectsFreed[type],
+                stats->objectsAllocated[type] - stats->objectsFreed[type],
+                stats->objectBytesAllocated[type],
+                stats->objectBytesFreed[type]);
+    }
+}
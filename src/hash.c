@@ -0,0 +1,109 @@
+//
+// Created by aucker on 10/17/2026.
+//
+
+#include <string.h>
+
+#include "hash.h"
+
+// Odd constants with well-spread bits, from wyhash.
+#define HASH_P0 0xa0761d6478bd642full
+#define HASH_P1 0xe7037ed1a0b428dbull
+#define HASH_P2 0x8ebc6af09c88c6dbull
+#define HASH_P3 0x589965cc75374cc3ull
+
+// Unaligned loads. The byte order doesn't matter, only that it's the same
+// every time.
+static uint64_t read64(const char* p) {
+    uint64_t word;
+    memcpy(&word, p, sizeof(word));
+    return word;
+}
+
+static uint64_t read32(const char* p) {
+    uint32_t word;
+    memcpy(&word, p, sizeof(word));
+    return word;
+}
+
+// Replaces `a` and `b` with the low and high halves of their product.
+static void multiply(uint64_t* a, uint64_t* b) {
+#ifdef __SIZEOF_INT128__
+    __uint128_t product = (__uint128_t)*a * *b;
+    *a = (uint64_t)product;
+    *b = (uint64_t)(product >> 64);
+#else
+    uint64_t aHigh = *a >> 32, aLow = (uint32_t)*a;
+    uint64_t bHigh = *b >> 32, bLow = (uint32_t)*b;
+    uint64_t high = aHigh * bHigh, middle0 = aHigh * bLow;
+    uint64_t middle1 = aLow * bHigh, low = aLow * bLow;
+    uint64_t t = low + (middle0 << 32);
+    uint64_t carry = t < low;
+    uint64_t productLow = t + (middle1 << 32);
+    carry += productLow < t;
+    *a = productLow;
+    *b = high + (middle0 >> 32) + (middle1 >> 32) + carry;
+#endif
+}
+
+// The product of `a` and `b`, folded to 64 bits.
+static uint64_t mix(uint64_t a, uint64_t b) {
+    multiply(&a, &b);
+    return a ^ b;
+}
+
+/*
+ * wyhash, eight bytes at a time: every 16 bytes go through one wide
+ * multiply, and long strings run three of those chains side by side so
+ * the multiplies overlap. Short strings, the identifiers and keys that
+ * make up most of what's interned, are a couple of overlapping loads
+ * with no loop at all.
+ */
+uint32_t hashString(const char* key, int length) {
+    const char* p = key;
+    size_t remaining = (size_t)length;
+    uint64_t seed = mix(HASH_P0, HASH_P1);
+    uint64_t a, b;
+
+    if (remaining <= 16) {
+        if (remaining >= 4) {
+            // Two loads from each end, overlapping for fewer than 8 bytes.
+            size_t offset = (remaining >> 3) << 2;
+            a = (read32(p) << 32) | read32(p + offset);
+            b = (read32(p + remaining - 4) << 32) |
+                read32(p + remaining - 4 - offset);
+        } else if (remaining > 0) {
+            a = ((uint64_t)(uint8_t)p[0] << 16) |
+                ((uint64_t)(uint8_t)p[remaining >> 1] << 8) |
+                (uint8_t)p[remaining - 1];
+            b = 0;
+        } else {
+            a = b = 0;
+        }
+    } else {
+        if (remaining > 48) {
+            uint64_t seed1 = seed, seed2 = seed;
+            do {
+                seed = mix(read64(p) ^ HASH_P1, read64(p + 8) ^ seed);
+                seed1 = mix(read64(p + 16) ^ HASH_P2, read64(p + 24) ^ seed1);
+                seed2 = mix(read64(p + 32) ^ HASH_P3, read64(p + 40) ^ seed2);
+                p += 48;
+                remaining -= 48;
+            } while (remaining > 48);
+            seed ^= seed1 ^ seed2;
+        }
+        while (remaining > 16) {
+            seed = mix(read64(p) ^ HASH_P1, read64(p + 8) ^ seed);
+            p += 16;
+            remaining -= 16;
+        }
+        // The last 16 bytes, which may overlap what the loop took.
+        a = read64(p + remaining - 16);
+        b = read64(p + remaining - 8);
+    }
+
+    a ^= HASH_P1;
+    b ^= seed;
+    multiply(&a, &b);
+    return (uint32_t)mix(a ^ HASH_P0 ^ (uint64_t)length, b ^ HASH_P1);
+}
@@ -0,0 +1,368 @@
+//
+// Created by aucker on 10/16/2026.
+//
+
+// For MAP_ANONYMOUS, which isn't in C99 or older POSIX.
+#define _DEFAULT_SOURCE
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "heap.h"
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <sys/mman.h>
+#ifndef MAP_ANONYMOUS
+#define MAP_ANONYMOUS MAP_ANON
+#endif
+#endif
+
+#define SIZE_CLASS(size) ((int)(((size) - 1) / HEAP_GRANULE))
+#define CLASS_SIZE(sizeClass) ((size_t)((sizeClass) + 1) * HEAP_GRANULE)
+// Blocks start past the page header, rounded up to a granule.
+#define PAGE_HEADER_SIZE \
+    ((sizeof(HeapPage) + HEAP_GRANULE - 1) & ~(size_t)(HEAP_GRANULE - 1))
+#define CHUNK_SIZE ((size_t)HEAP_PAGE_SIZE * HEAP_CHUNK_PAGES)
+
+void initHeap(Heap* heap) {
+    heap->pages = NULL;
+    for (int i = 0; i < HEAP_SIZE_CLASSES; i++) {
+        heap->openPages[i] = NULL;
+    }
+    heap->emptyPages = NULL;
+    heap->freePages = NULL;
+    heap->pageCount = 0;
+    heap->freePageCount = 0;
+    heap->chunkNext = NULL;
+    heap->chunkEnd = NULL;
+}
+
+#ifdef _WIN32
+
+// VirtualAlloc() already hands out 64 KiB aligned regions.
+static void* allocatePageMemory(Heap* heap) {
+    void* memory = VirtualAlloc(NULL, HEAP_PAGE_SIZE,
+                                MEM_RESERVE | MEM_COMMIT, PAGE_READWRITE);
+    return memory;
+}
+
+static void unmapMemory(void* memory, size_t size) {
+    VirtualFree(memory, 0, MEM_RELEASE);
+}
+
+#else
+
+static void unmapMemory(void* memory, size_t size) {
+    if (size != 0) munmap(memory, size);
+}
+
+/*
+ * Maps a chunk with a page to spare, then trims the ends so what's left
+ * starts on a page boundary.
+ */
+static bool mapChunk(Heap* heap) {
+    size_t size = CHUNK_SIZE + HEAP_PAGE_SIZE;
+    char* memory = mmap(NULL, size, PROT_READ | PROT_WRITE,
+                        MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (memory == MAP_FAILED) return false;
+
+    char* start = (char*)(((uintptr_t)memory + HEAP_PAGE_SIZE - 1) &
+                          ~(uintptr_t)(HEAP_PAGE_SIZE - 1));
+    unmapMemory(memory, start - memory);
+    unmapMemory(start + CHUNK_SIZE, memory + size - (start + CHUNK_SIZE));
+
+    heap->chunkNext = start;
+    heap->chunkEnd = start + CHUNK_SIZE;
+    return true;
+}
+
+static void* allocatePageMemory(Heap* heap) {
+    if (heap->chunkNext == heap->chunkEnd && !mapChunk(heap)) return NULL;
+    void* memory = heap->chunkNext;
+    heap->chunkNext += HEAP_PAGE_SIZE;
+    return memory;
+}
+
+#endif
+
+static void freePageMemory(HeapPage* page) {
+    free(page->markBits);
+    unmapMemory(page, HEAP_PAGE_SIZE);
+}
+
+static void linkOpen(Heap* heap, HeapPage* page) {
+    HeapPage** head = &heap->openPages[page->sizeClass];
+    page->prevOpen = NULL;
+    page->nextOpen = *head;
+    if (*head != NULL) (*head)->prevOpen = page;
+    *head = page;
+}
+
+static void unlinkOpen(Heap* heap, HeapPage* page) {
+    if (page->prevOpen != NULL) {
+        page->prevOpen->nextOpen = page->nextOpen;
+    } else if (heap->openPages[page->sizeClass] == page) {
+        heap->openPages[page->sizeClass] = page->nextOpen;
+    }
+    if (page->nextOpen != NULL) page->nextOpen->prevOpen = page->prevOpen;
+    page->prevOpen = NULL;
+    page->nextOpen = NULL;
+}
+
+static bool isFull(HeapPage* page) {
+    return page->freeList == NULL && page->bump == page->end;
+}
+
+static HeapPage* newPage(Heap* heap, int sizeClass) {
+    HeapPage* page = heap->freePages;
+    if (page != NULL) {
+        heap->freePages = page->nextEmpty;
+        heap->freePageCount--;
+    } else {
+        uint64_t* markBits = (uint64_t*)malloc(sizeof(uint64_t) *
+                                               HEAP_BITMAP_WORDS);
+        if (markBits == NULL) return NULL;
+        page = (HeapPage*)allocatePageMemory(heap);
+        if (page == NULL) {
+            free(markBits);
+            return NULL;
+        }
+        page->markBits = markBits;
+    }
+
+    size_t blockSize = CLASS_SIZE(sizeClass);
+    size_t blockCount = (HEAP_PAGE_SIZE - PAGE_HEADER_SIZE) / blockSize;
+
+    page->freeList = NULL;
+    page->bump = (char*)page + PAGE_HEADER_SIZE;
+    page->end = page->bump + blockCount * blockSize;
+    page->sizeClass = sizeClass;
+    page->liveCount = 0;
+    page->isEvacuating = false;
+    page->isQueued = false;
+    page->nextEmpty = NULL;
+    memset(page->objectBits, 0, sizeof(page->objectBits));
+    memset(page->markBits, 0, sizeof(uint64_t) * HEAP_BITMAP_WORDS);
+
+    page->prev = NULL;
+    page->next = heap->pages;
+    if (heap->pages != NULL) heap->pages->prev = page;
+    heap->pages = page;
+    heap->pageCount++;
+
+    linkOpen(heap, page);
+    return page;
+}
+
+static void releasePage(Heap* heap, HeapPage* page) {
+    unlinkOpen(heap, page);
+    if (page->prev != NULL) {
+        page->prev->next = page->next;
+    } else {
+        heap->pages = page->next;
+    }
+    if (page->next != NULL) page->next->prev = page->prev;
+    heap->pageCount--;
+
+    page->nextEmpty = heap->freePages;
+    heap->freePages = page;
+    heap->freePageCount++;
+}
+
+/*
+ * Takes a block from the first page of the class with room: a freed one if
+ * there is one, else the next one never used. A page that fills up leaves
+ * the list, so the next allocation doesn't have to look at it.
+ */
+static void* allocateBlock(Heap* heap, int sizeClass) {
+    HeapPage* page = heap->openPages[sizeClass];
+    if (page == NULL) page = newPage(heap, sizeClass);
+    if (page == NULL) return NULL;
+
+    void* block;
+    if (page->freeList != NULL) {
+        block = page->freeList;
+        page->freeList = *(void**)block;
+    } else {
+        block = page->bump;
+        page->bump += CLASS_SIZE(sizeClass);
+    }
+
+    page->liveCount++;
+    if (isFull(page)) unlinkOpen(heap, page);
+    return block;
+}
+
+static void freeBlock(Heap* heap, void* block) {
+    HeapPage* page = HEAP_PAGE_OF(block);
+    if (isFull(page)) linkOpen(heap, page);
+    page->objectBits[HEAP_BIT_WORD(block)] &= ~HEAP_BIT_MASK(block);
+
+    *(void**)block = page->freeList;
+    page->freeList = block;
+
+    if (--page->liveCount == 0 && !page->isQueued) {
+        page->isQueued = true;
+        page->nextEmpty = heap->emptyPages;
+        heap->emptyPages = page;
+    }
+}
+
+static void* allocateMemory(Heap* heap, size_t size) {
+    if (size <= HEAP_MAX_SMALL) return allocateBlock(heap, SIZE_CLASS(size));
+    return malloc(size);
+}
+
+static void freeMemory(Heap* heap, void* pointer, size_t size) {
+    if (size <= HEAP_MAX_SMALL) {
+        freeBlock(heap, pointer);
+    } else {
+        free(pointer);
+    }
+}
+
+/*
+ * Same contract as reallocate(), minus the collecting: `oldSize` has to be
+ * what the block was allocated with, since that's the only way to tell
+ * which class, or libc, it came from. A block that changes class is moved.
+ * If there's no memory to be had, this returns NULL and leaves the old
+ * block as it was.
+ */
+void* heapReallocate(Heap* heap, void* pointer, size_t oldSize,
+                     size_t newSize) {
+    if (pointer == NULL) oldSize = 0;
+
+    if (newSize == 0) {
+        if (oldSize != 0) freeMemory(heap, pointer, oldSize);
+        return NULL;
+    }
+
+    if (oldSize > HEAP_MAX_SMALL && newSize > HEAP_MAX_SMALL) {
+        return realloc(pointer, newSize);
+    }
+
+    if (oldSize != 0 && newSize <= HEAP_MAX_SMALL &&
+        SIZE_CLASS(oldSize) == SIZE_CLASS(newSize)) {
+        return pointer;
+    }
+
+    void* result = allocateMemory(heap, newSize);
+    if (result != NULL && oldSize != 0) {
+        memcpy(result, pointer, oldSize < newSize ? oldSize : newSize);
+        freeMemory(heap, pointer, oldSize);
+    }
+    return result;
+}
+
+/*
+ * Takes the pages that are still empty out of their classes, except the
+ * last page with room in a class, which is kept for whatever gets
+ * allocated there next.
+ */
+void releaseEmptyPages(Heap* heap) {
+    HeapPage* page = heap->emptyPages;
+    while (page != NULL) {
+        HeapPage* next = page->nextEmpty;
+        page->isQueued = false;
+        page->nextEmpty = NULL;
+
+        bool isOnlyOpen = page->prevOpen == NULL && page->nextOpen == NULL;
+        if (page->liveCount == 0 && !isOnlyOpen) releasePage(heap, page);
+        page = next;
+    }
+    heap->emptyPages = NULL;
+}
+
+void clearMarkBits(Heap* heap) {
+    for (HeapPage* page = heap->pages; page != NULL; page = page->next) {
+        memset(page->markBits, 0, sizeof(uint64_t) * HEAP_BITMAP_WORDS);
+    }
+}
+
+static int pageCapacity(HeapPage* page) {
+    return (int)((page->end - ((char*)page + PAGE_HEADER_SIZE)) /
+                 HEAP_BLOCK_SIZE(page));
+}
+
+// How full the pages are, as a percentage of the blocks they hold.
+int heapOccupancy(Heap* heap) {
+    size_t live = 0;
+    size_t capacity = 0;
+    for (HeapPage* page = heap->pages; page != NULL; page = page->next) {
+        live += (size_t)page->liveCount * HEAP_BLOCK_SIZE(page);
+        capacity += (size_t)pageCapacity(page) * HEAP_BLOCK_SIZE(page);
+    }
+    return capacity == 0 ? 100 : (int)(live * 100 / capacity);
+}
+
+/*
+ * Picks the pages less than `occupancy` percent full to be evacuated, in
+ * the classes that have more than one page, and takes them out of their
+ * open lists so nothing new is allocated there. Returns how many it took.
+ */
+int selectEvacuationPages(Heap* heap, int occupancy) {
+    // A queued page might be released out from under the compaction.
+    releaseEmptyPages(heap);
+
+    int pagesInClass[HEAP_SIZE_CLASSES] = {0};
+    for (HeapPage* page = heap->pages; page != NULL; page = page->next) {
+        pagesInClass[page->sizeClass]++;
+    }
+
+    int count = 0;
+    for (HeapPage* page = heap->pages; page != NULL; page = page->next) {
+        if (pagesInClass[page->sizeClass] < 2) continue;
+        if (page->liveCount * 100 >= occupancy * pageCapacity(page)) continue;
+
+        page->isEvacuating = true;
+        unlinkOpen(heap, page);
+        count++;
+    }
+    return count;
+}
+
+/*
+ * Drops the evacuated pages whole. Everything on them was copied out, so
+ * their blocks aren't freed one by one.
+ */
+void releaseEvacuatedPages(Heap* heap) {
+    HeapPage* page = heap->pages;
+    while (page != NULL) {
+        HeapPage* next = page->next;
+        if (page->isEvacuating) {
+            memset(page->objectBits, 0, sizeof(page->objectBits));
+            page->liveCount = 0;
+            page->isEvacuating = false;
+            releasePage(heap, page);
+        }
+        page = next;
+    }
+    trimHeap(heap);
+}
+
+void trimHeap(Heap* heap) {
+    HeapPage* page = heap->freePages;
+    while (page != NULL) {
+        HeapPage* next = page->nextEmpty;
+        freePageMemory(page);
+        page = next;
+    }
+    heap->freePages = NULL;
+    heap->freePageCount = 0;
+}
+
+void freeHeap(Heap* heap) {
+    HeapPage* page = heap->pages;
+    while (page != NULL) {
+        HeapPage* next = page->next;
+        freePageMemory(page);
+        page = next;
+    }
+    trimHeap(heap);
+    if (heap->chunkNext != NULL) {
+        unmapMemory(heap->chunkNext, heap->chunkEnd - heap->chunkNext);
+    }
+    initHeap(heap);
+}
@@ -5,8 +5,11 @@
 #include "chunk.h"
 #include "common.h"
 #include "debug.h"
+#include "memory.h"
 #include "vm.h"
 
+static bool showGCStats = false;
+
 static void repl() {
     char line[1024];
     for (;;) {
@@ -50,11 +53,33 @@ static char* readFile(const char* path) {
     return buffer;
 }
 
+static void reportGCStats() {
+    if (!showGCStats) return;
+    fflush(stdout);
+    GCStats stats;
+    readGCStats(&stats);
+    printGCStats(&stats, stderr);
+}
+
+static void usage() {
+    fprintf(stderr, "Usage: clox [options] [path]\n"
+                    "  --heap-initial=SIZE  heap size of the first full GC\n"
+                    "  --heap-min=SIZE      never start a full GC below this\n"
+                    "  --heap-max=SIZE      out of memory past this\n"
+                    "  --heap-grow=FACTOR   heap growth between full GCs\n"
+                    "  --gc-target=PERCENT  adapt the growth to spend this\n"
+                    "                       share of the time collecting\n"
+                    "  --gc-stats           print GC stats when done\n"
+                    "SIZE is in bytes, or with a K, M or G suffix.\n");
+    exit(64);
+}
+
 static void runFile(const char* path) {
     char* source = readFile(path);
     InterpretResult result = interpret(source);
     free(source);
 
+    if (result != INTERPRET_OK) reportGCStats();
     if (result == INTERPRET_COMPILE_ERROR) exit(65);
     if (result == INTERPRET_RUNTIME_ERROR) exit(70);
 }
@@ -89,15 +114,28 @@ int main(int argc, const char* argv[]) {
 //    freeVM();
 //    freeChunk(&chunk);
 
-    if (argc == 1) {
+    GCPolicy policy = vm.gcPolicy;
+    int arg = 1;
+    while (arg < argc && strncmp(argv[arg], "--", 2) == 0) {
+        if (strcmp(argv[arg], "--gc-stats") == 0) {
+            showGCStats = true;
+        } else if (!parseGCOption(&policy, argv[arg])) {
+            fprintf(stderr, "Unknown option \"%s\".\n", argv[arg]);
+            usage();
+        }
+        arg++;
+    }
+    setGCPolicy(&policy);
+
+    if (arg == argc) {
         repl();
-    } else if (argc == 2) {
-        runFile(argv[1]);
+    } else if (arg == argc - 1) {
+        runFile(argv[arg]);
     } else {
-        fprintf(stderr, "Usage: clox [path]\n");
-        exit(64);
+        usage();
     }
 
+    reportGCStats();
     freeVM();
     return 0;
 }
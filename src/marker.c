@@ -0,0 +1,258 @@
+//
+// Created by aucker on 10/16/2026.
+//
+
+#ifdef PARALLEL_MARK
+
+// For sysconf() and sched_yield(), which aren't in C99.
+#define _DEFAULT_SOURCE
+
+#include <pthread.h>
+#include <sched.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include "marker.h"
+#include "memory.h"
+
+#define INITIAL_DEQUE_CAPACITY 1024
+
+/*
+ * A worker's deque is a Chase-Lev work-stealing deque. The owner pushes
+ * and pops at `bottom`, thieves take from `top`, and only the last object
+ * is ever raced for, with a compare-and-swap on `top`. Indices only grow;
+ * they're masked into the ring buffer.
+ */
+typedef struct GrayBuffer {
+    int64_t capacity;
+    // The buffer this one replaced. A thief may still be reading it, so
+    // it's kept until the marking is over.
+    struct GrayBuffer* previous;
+    Obj* items[];
+} GrayBuffer;
+
+typedef struct {
+    int64_t top;
+    int64_t bottom;
+    GrayBuffer* buffer;
+    pthread_t thread;
+    bool isRunning;
+    // Where the next steal starts looking, so thieves spread out.
+    unsigned int victim;
+    // Keeps the next worker's indices off this one's cache line.
+    char padding[64];
+} MarkWorker;
+
+static MarkWorker* workers;
+static int workerCount;
+static int idleWorkers;
+static __thread MarkWorker* currentWorker;
+
+static GrayBuffer* newBuffer(int64_t capacity, GrayBuffer* previous) {
+    GrayBuffer* buffer = (GrayBuffer*)malloc(sizeof(GrayBuffer) +
+                                             sizeof(Obj*) * capacity);
+    if (buffer == NULL) exit(1);
+    buffer->capacity = capacity;
+    buffer->previous = previous;
+    return buffer;
+}
+
+static Obj** slot(GrayBuffer* buffer, int64_t index) {
+    return &buffer->items[index & (buffer->capacity - 1)];
+}
+
+static GrayBuffer* growDeque(MarkWorker* worker, int64_t top,
+                             int64_t bottom) {
+    GrayBuffer* old = worker->buffer;
+    GrayBuffer* buffer = newBuffer(old->capacity * 2, old);
+    for (int64_t i = top; i < bottom; i++) {
+        *slot(buffer, i) = __atomic_load_n(slot(old, i), __ATOMIC_RELAXED);
+    }
+    __atomic_store_n(&worker->buffer, buffer, __ATOMIC_RELEASE);
+    return buffer;
+}
+
+static void pushWork(MarkWorker* worker, Obj* object) {
+    int64_t bottom = __atomic_load_n(&worker->bottom, __ATOMIC_RELAXED);
+    int64_t top = __atomic_load_n(&worker->top, __ATOMIC_ACQUIRE);
+    GrayBuffer* buffer = worker->buffer;
+    if (bottom - top > buffer->capacity - 1) {
+        buffer = growDeque(worker, top, bottom);
+    }
+    __atomic_store_n(slot(buffer, bottom), object, __ATOMIC_RELAXED);
+    __atomic_store_n(&worker->bottom, bottom + 1, __ATOMIC_RELEASE);
+}
+
+static Obj* popWork(MarkWorker* worker) {
+    int64_t bottom = __atomic_load_n(&worker->bottom, __ATOMIC_RELAXED) - 1;
+    GrayBuffer* buffer = worker->buffer;
+    __atomic_store_n(&worker->bottom, bottom, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    int64_t top = __atomic_load_n(&worker->top, __ATOMIC_RELAXED);
+
+    if (top > bottom) {
+        __atomic_store_n(&worker->bottom, bottom + 1, __ATOMIC_RELAXED);
+        return NULL;
+    }
+
+    Obj* object = __atomic_load_n(slot(buffer, bottom), __ATOMIC_RELAXED);
+    if (top == bottom) {
+        // The last one. A thief may be after it too.
+        if (!__atomic_compare_exchange_n(&worker->top, &top, top + 1, false,
+                                         __ATOMIC_SEQ_CST,
+                                         __ATOMIC_RELAXED)) {
+            object = NULL;
+        }
+        __atomic_store_n(&worker->bottom, bottom + 1, __ATOMIC_RELAXED);
+    }
+    return object;
+}
+
+// Returns NULL if `victim` had nothing, or another thread got there first.
+static Obj* stealWork(MarkWorker* victim) {
+    int64_t top = __atomic_load_n(&victim->top, __ATOMIC_ACQUIRE);
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    int64_t bottom = __atomic_load_n(&victim->bottom, __ATOMIC_ACQUIRE);
+    if (top >= bottom) return NULL;
+
+    GrayBuffer* buffer = __atomic_load_n(&victim->buffer, __ATOMIC_ACQUIRE);
+    Obj* object = __atomic_load_n(slot(buffer, top), __ATOMIC_RELAXED);
+    if (!__atomic_compare_exchange_n(&victim->top, &top, top + 1, false,
+                                     __ATOMIC_SEQ_CST, __ATOMIC_RELAXED)) {
+        return NULL;
+    }
+    return object;
+}
+
+static bool hasWork(MarkWorker* worker) {
+    return __atomic_load_n(&worker->top, __ATOMIC_ACQUIRE) <
+           __atomic_load_n(&worker->bottom, __ATOMIC_ACQUIRE);
+}
+
+static Obj* stealFromAnyone(MarkWorker* self) {
+    for (int i = 0; i < workerCount; i++) {
+        MarkWorker* victim = &workers[self->victim++ % workerCount];
+        if (victim == self) continue;
+
+        Obj* object = stealWork(victim);
+        if (object != NULL) return object;
+    }
+    return NULL;
+}
+
+static bool anyoneHasWork() {
+    for (int i = 0; i < workerCount; i++) {
+        if (hasWork(&workers[i])) return true;
+    }
+    return false;
+}
+
+/*
+ * Blackens objects until every deque is empty. A worker that finds nothing
+ * to steal counts itself idle, and the marking is over once they all are:
+ * only a busy worker can gray anything, so nothing more can turn up. One
+ * that sees work again stops being idle before it tries to steal it.
+ */
+static void drain(MarkWorker* self) {
+    for (;;) {
+        Obj* object;
+        while ((object = popWork(self)) != NULL) {
+            blackenObject(object);
+        }
+
+        object = stealFromAnyone(self);
+        if (object != NULL) {
+            blackenObject(object);
+            continue;
+        }
+
+        __atomic_fetch_add(&idleWorkers, 1, __ATOMIC_SEQ_CST);
+        for (;;) {
+            if (__atomic_load_n(&idleWorkers, __ATOMIC_SEQ_CST) ==
+                workerCount) {
+                return;
+            }
+            if (anyoneHasWork()) {
+                __atomic_fetch_sub(&idleWorkers, 1, __ATOMIC_SEQ_CST);
+                break;
+            }
+            sched_yield();
+        }
+    }
+}
+
+static void* runWorker(void* argument) {
+    currentWorker = (MarkWorker*)argument;
+    drain(currentWorker);
+    currentWorker = NULL;
+    return NULL;
+}
+
+int defaultMarkThreads() {
+    if (GC_MARK_THREADS > 0) return GC_MARK_THREADS;
+
+    long cores = sysconf(_SC_NPROCESSORS_ONLN);
+    if (cores < 1) return 1;
+    return cores < GC_MAX_MARK_THREADS ? (int)cores : GC_MAX_MARK_THREADS;
+}
+
+/*
+ * Traces everything on vm.grayStack. Its objects are dealt out to the
+ * workers, then the calling thread marks alongside the ones it starts. A
+ * thread that can't be started counts as idle from the outset, and the
+ * others steal what was dealt to it.
+ */
+void traceInParallel(int threadCount) {
+    workerCount = threadCount;
+    workers = (MarkWorker*)calloc(threadCount, sizeof(MarkWorker));
+    if (workers == NULL) exit(1);
+    for (int i = 0; i < threadCount; i++) {
+        workers[i].buffer = newBuffer(INITIAL_DEQUE_CAPACITY, NULL);
+        workers[i].victim = (unsigned int)i + 1;
+    }
+
+    for (int i = 0; i < vm.grayCount; i++) {
+        pushWork(&workers[i % threadCount], vm.grayStack[i]);
+    }
+    vm.grayCount = 0;
+
+    idleWorkers = 0;
+    vm.markingInParallel = true;
+    for (int i = 1; i < threadCount; i++) {
+        workers[i].isRunning = pthread_create(&workers[i].thread, NULL,
+                                              runWorker, &workers[i]) == 0;
+        if (!workers[i].isRunning) {
+            __atomic_fetch_add(&idleWorkers, 1, __ATOMIC_SEQ_CST);
+        }
+    }
+    runWorker(&workers[0]);
+
+    for (int i = 1; i < threadCount; i++) {
+        if (workers[i].isRunning) pthread_join(workers[i].thread, NULL);
+    }
+    vm.markingInParallel = false;
+
+    for (int i = 0; i < threadCount; i++) {
+        GrayBuffer* buffer = workers[i].buffer;
+        while (buffer != NULL) {
+            GrayBuffer* previous = buffer->previous;
+            free(buffer);
+            buffer = previous;
+        }
+    }
+    free(workers);
+    workers = NULL;
+}
+
+void markObjectInParallel(Obj* object) {
+    uint64_t* word = &HEAP_PAGE_OF(object)->markBits[HEAP_BIT_WORD(object)];
+    uint64_t mask = HEAP_BIT_MASK(object);
+    // Most references are to objects already marked, which a plain load
+    // finds out without taking the cache line away from anyone.
+    if (__atomic_load_n(word, __ATOMIC_RELAXED) & mask) return;
+    if (__atomic_fetch_or(word, mask, __ATOMIC_RELAXED) & mask) return;
+
+    pushWork(currentWorker, object);
+}
+
+#endif
@@ -1,18 +1,70 @@
 //
 // Created by aucker on 10/7/2023.
 //
+#include <setjmp.h>
+#include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#ifdef CONCURRENT_SWEEP
+#include <pthread.h>
+#endif
 
 #include "compiler.h"
+#include "marker.h"
 #include "memory.h"
 #include "vm.h"
 
 #ifdef DEBUG_LOG_GC
-#include <stdio.h>
 #include "debug.h"
 #endif
 
-#define GC_HEAP_GROW_FACTOR 2
+static void beginCycle();
+static void finishCycle();
+static void markSlice();
+static void sweepSlice(int budget);
+static void collectYoungGarbage();
+static void outOfMemory();
+
+// Times what the VM waits on the collector for, for the stats and the
+// GC policy both.
+static void beginPause() {
+    beginGCPause(&vm.gcStats);
+}
+
+static void endPause() {
+    vm.gcPolicy.gcSeconds += endGCPause(&vm.gcStats);
+}
+
+#ifdef CONCURRENT_SWEEP
+/*
+ * While a background sweep runs, the sweeper and the VM share the heap
+ * pages, their bitmaps and the intern table, and `heapLock` guards them.
+ * The sweeper holds it for a moment per page. The VM holds it from
+ * lockHeap() to unlockHeap(), which nest, and only takes it at all while
+ * there's a sweeper to keep out.
+ */
+static pthread_mutex_t heapLock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_t sweeperThread;
+static bool sweeperDone;
+// Freed by the sweeper, and taken off vm.bytesAllocated once it's done.
+static size_t sweptBytes;
+static __thread bool isSweeperThread = false;
+/*
+ * The sweeper's own lists, outside the GC'd heap: the dead objects on the
+ * page it's on, and the small blocks freeing them gave back, which go back
+ * on their pages in one batch.
+ */
+static Obj** deadObjects;
+static int deadCount;
+static int deadCapacity;
+static void** pendingBlocks;
+static size_t* pendingSizes;
+static int pendingCount;
+static int pendingCapacity;
+
+static void startSweeper();
+static void deferFree(void* block, size_t size);
+#endif
 
 /**
  * There're four actions for reallocate, all we care is oldSize and newSize:
@@ -26,42 +78,123 @@
  * @return
  */
 void* reallocate(void* pointer, size_t oldSize, size_t newSize) {
+#ifdef CONCURRENT_SWEEP
+    // The sweeper only ever frees.
+    if (vm.sweeperRunning && isSweeperThread) {
+        sweptBytes += oldSize;
+        deferFree(pointer, oldSize);
+        return NULL;
+    }
+#endif
+
     vm.bytesAllocated += newSize - oldSize;
     if (newSize > oldSize) {
 #ifdef DEBUG_STRESS_GC
-        collectGarbage();
+        // Mostly young collections, with a full one started now and then
+        // so old objects get freed too.
+        static int stressCount = 0;
+        if (vm.gcPhase == GC_IDLE && ++stressCount % 16 == 0) {
+            beginCycle();
+        } else if (vm.gcPhase != GC_MARK) {
+            collectYoungGarbage();
+        }
 #endif
 
         // we need to call our GC
-        if (vm.bytesAllocated > vm.nextGC) {
+        if (vm.gcPhase == GC_IDLE && vm.bytesAllocated > vm.nextGC) {
+            beginCycle();
+        } else if (vm.gcPhase != GC_MARK &&
+                   vm.bytesAllocated > vm.nextYoungGC) {
+            collectYoungGarbage();
+        }
+
+        if (vm.gcPhase == GC_MARK) {
+            markSlice();
+        } else if (vm.gcPhase == GC_SWEEP) {
+            sweepSlice(vm.gcSliceBudget);
+        }
+
+        // Past the cap, only a full collection can make room.
+        size_t maxHeap = vm.gcPolicy.maxHeap;
+        if (maxHeap != 0 && vm.bytesAllocated > maxHeap) {
             collectGarbage();
+            if (vm.bytesAllocated > maxHeap) {
+                vm.bytesAllocated -= newSize - oldSize;
+                outOfMemory();
+            }
         }
     }
 
-    if (newSize == 0) {
-        free(pointer);
-        return NULL;
+    // Small blocks come from the VM's own pages, the rest from libc.
+    lockHeap();
+    void* result = heapReallocate(&vm.heap, pointer, oldSize, newSize);
+    unlockHeap();
+    if (result == NULL && newSize != 0) {
+        // The OS may take back what a full collection frees, so try again.
+        collectGarbage();
+        lockHeap();
+        result = heapReallocate(&vm.heap, pointer, oldSize, newSize);
+        unlockHeap();
+        if (result == NULL) {
+            vm.bytesAllocated -= newSize - oldSize;
+            outOfMemory();
+        }
     }
 
-    // when newSize if zero, we handle deallocation case ourselves by calling `free()`.
-    // Otherwise, we rely on C standard library's `realloc()` function.
-    void* result = realloc(pointer, newSize);
-    if (result == NULL) exit(1);  // allocation fail w/o enough memory
+    if (newSize > oldSize) {
+        vm.gcStats.bytesAllocated += newSize - oldSize;
+    } else {
+        vm.gcStats.bytesFreed += oldSize - newSize;
+    }
     return result;
 }
 
-void markObject(Obj* object) {
-    if (object == NULL) return;
-    // to handle the cyclic graph issue, infinite loop
-    if (object->isMarked) return;
-#ifdef DEBUG_LOG_GC
-    printf("%p mark ", (void*)object);
-    printValue(OBJ_VAL(object));
-    printf("\n");
+/*
+ * Unwinds to interpret(), which reports it as a runtime error. Whatever was
+ * being allocated is abandoned, but the heap itself is left in order.
+ */
+static void outOfMemory() {
+    // Nothing that's unwound will get to unlock the heap.
+    vm.heapLockDepth = 0;
+#ifdef CONCURRENT_SWEEP
+    if (vm.heapLockTaken) releaseHeapLock();
 #endif
 
-    object->isMarked = true;
+    if (vm.errorJump == NULL) {
+        fprintf(stderr, "Out of memory.\n");
+        exit(1);
+    }
+    longjmp(*vm.errorJump, 1);
+}
 
+#ifdef CONCURRENT_SWEEP
+void acquireHeapLock() {
+    pthread_mutex_lock(&heapLock);
+    vm.heapLockTaken = true;
+}
+
+void releaseHeapLock() {
+    vm.heapLockTaken = false;
+    pthread_mutex_unlock(&heapLock);
+}
+#endif
+
+void rememberObject(Obj* object) {
+    if (!object->isOld || object->isRemembered) return;
+    object->isRemembered = true;
+
+    if (vm.rememberedCapacity < vm.rememberedCount + 1) {
+        vm.rememberedCapacity = GROW_CAPACITY(vm.rememberedCapacity);
+        // Like the gray stack, this lives outside the GC'd heap.
+        vm.remembered = (Obj**)realloc(vm.remembered,
+                                       sizeof(Obj*) * vm.rememberedCapacity);
+        if (vm.remembered == NULL) exit(1);
+    }
+
+    vm.remembered[vm.rememberedCount++] = object;
+}
+
+static void pushGray(Obj* object) {
     // the capacity is not enough, grow it
     if (vm.grayCapacity < vm.grayCount + 1) {
         vm.grayCapacity = GROW_CAPACITY(vm.grayCapacity);
@@ -84,6 +217,34 @@ void markObject(Obj* object) {
     vm.grayStack[vm.grayCount++] = object;
 }
 
+void markObject(Obj* object) {
+    if (object == NULL) return;
+#ifdef PARALLEL_MARK
+    if (vm.markingInParallel) {
+        markObjectInParallel(object);
+        return;
+    }
+#endif
+    // to handle the cyclic graph issue, infinite loop
+    if (isMarked(object)) return;
+    // A young collection takes every old object to be live.
+    if (vm.collectingYoung && object->isOld) return;
+#ifdef DEBUG_LOG_GC
+    printf("%p mark ", (void*)object);
+    printValue(OBJ_VAL(object));
+    printf("\n");
+#endif
+
+    setMarked(object);
+    pushGray(object);
+}
+
+void writeBarrierAll(Obj* owner) {
+    rememberObject(owner);
+    // Graying it again has the marker scan it over.
+    if (vm.gcPhase == GC_MARK && isMarked(owner)) pushGray(owner);
+}
+
 void markValue(Value value) {
     // we only care about the heap allocated value, not [numbers, Boolean, nil]
     // cause they are inline in Value, requires no heap allocation.
@@ -96,7 +257,11 @@ static void markArray(ValueArray* array) {
     }
 }
 
-static void blackenObject(Obj* object) {
+/*
+ * Returns roughly how many references it had to look at, which is what a
+ * marking slice is budgeted in.
+ */
+int blackenObject(Obj* object) {
 #ifdef DEBUG_LOG_GC
     printf("%p blacken ", (void*)object);
     printValue(OBJ_VAL(object));
@@ -119,13 +284,14 @@ static void blackenObject(Obj* object) {
             ObjBoundMethod* bound = (ObjBoundMethod*)object;
             markValue(bound->receiver);
             markObject((Obj*)bound->method);
-            break;
+            return 3;
         }
         case OBJ_CLASS: {
             ObjClass* klass = (ObjClass*)object;
             markObject((Obj*)klass->name);
             markTable(&klass->methods);
-            break;
+            markObject((Obj*)klass->shape);
+            return 3 + klass->methods.capacity;
         }
         case OBJ_CLOSURE: {
             ObjClosure* closure = (ObjClosure*)object;
@@ -133,27 +299,76 @@ static void blackenObject(Obj* object) {
             for (int i = 0; i < closure->upvalueCount; i++) {
                 markObject((Obj*)closure->upvalues[i]);
             }
-            break;
+            return 2 + closure->upvalueCount;
         }
         case OBJ_FUNCTION: {
             ObjFunction* function = (ObjFunction*)object;
             markObject((Obj*)function->name);
             markArray(&function->chunk.constants);
-            break;
+            // Cached shapes must stay alive, or a new shape allocated at
+            // the same address would hit a stale way.
+            for (int i = 0; i < function->chunk.cacheCount; i++) {
+                InlineCache* cache = &function->chunk.caches[i];
+                for (int j = 0; j < INLINE_CACHE_WAYS; j++) {
+                    markObject(cache->ways[j].shape);
+                    markObject(cache->ways[j].target);
+                }
+            }
+            return 2 + function->chunk.constants.count +
+                   function->chunk.cacheCount * INLINE_CACHE_WAYS * 2;
         }
         case OBJ_INSTANCE: {
             ObjInstance* instance = (ObjInstance*)object;
             markObject((Obj*)instance->klass);
-            markTable(&instance->fields);
-            break;
+            markObject((Obj*)instance->shape);
+            for (int i = 0; i < instance->shape->fieldCount; i++) {
+                markValue(instance->fields[i]);
+            }
+            return 3 + instance->shape->fieldCount;
+        }
+        case OBJ_SHAPE: {
+            ObjShape* shape = (ObjShape*)object;
+            markTable(&shape->slots);
+            markTable(&shape->transitions);
+            return 1 + shape->slots.capacity + shape->transitions.capacity;
+        }
+        case OBJ_STRING: {
+            ObjString* string = (ObjString*)object;
+            markObject((Obj*)string->left);
+            markObject((Obj*)string->right);
+            return 3;
         }
         case OBJ_UPVALUE:
             markValue(((ObjUpvalue*)object)->closed);
-            break;
+            return 2;
         case OBJ_NATIVE:
-        case OBJ_STRING:
             break;
     }
+    return 1;
+}
+
+// What allocateObject() was asked for.
+static size_t objectSize(Obj* object) {
+    switch (object->type) {
+        case OBJ_BOUND_METHOD: return sizeof(ObjBoundMethod);
+        case OBJ_CLASS: return sizeof(ObjClass);
+        case OBJ_CLOSURE: return sizeof(ObjClosure);
+        case OBJ_FUNCTION: return sizeof(ObjFunction);
+        case OBJ_INSTANCE:
+            return sizeof(ObjInstance) +
+                   sizeof(Value) * ((ObjInstance*)object)->inlineCapacity;
+        case OBJ_NATIVE: return sizeof(ObjNative);
+        case OBJ_SHAPE: return sizeof(ObjShape);
+        case OBJ_STRING: return stringSize((ObjString*)object);
+        case OBJ_UPVALUE: return sizeof(ObjUpvalue);
+    }
+    return 0;
+}
+
+// Counts an object the collector found dead, before it's freed.
+static void countDeadObject(Obj* object) {
+    vm.gcStats.objectsFreed[object->type]++;
+    vm.gcStats.objectBytesFreed[object->type] += objectSize(object);
 }
 
 static void freeObject(Obj* object) {
@@ -166,6 +381,8 @@ static void freeObject(Obj* object) {
             FREE(ObjBoundMethod, object);
             break;
         case OBJ_CLASS: {
+            ObjClass* klass = (ObjClass*)object;
+            freeTable(&klass->methods);
             FREE(ObjClass, object);
             break;
         }
@@ -185,18 +402,31 @@ static void freeObject(Obj* object) {
         }
         case OBJ_INSTANCE: {
             ObjInstance* instance = (ObjInstance*)object;
-            freeTable(&instance->fields);
-            FREE(ObjInstance, object);
+            if (instance->fields != instance->inlineFields) {
+                FREE_ARRAY(Value, instance->fields, instance->capacity);
+            }
+            reallocate(object, sizeof(ObjInstance) +
+                       sizeof(Value) * instance->inlineCapacity, 0);
             break;
         }
         case OBJ_NATIVE: {
             FREE(ObjNative, object);
             break;
         }
+        case OBJ_SHAPE: {
+            ObjShape* shape = (ObjShape*)object;
+            freeTable(&shape->slots);
+            freeTable(&shape->transitions);
+            FREE(ObjShape, object);
+            break;
+        }
         case OBJ_STRING: {
             ObjString* string = (ObjString*)object;
-            FREE_ARRAY(char, string->chars, string->length + 1);
-            FREE(ObjString, object);
+            if (string->chars != NULL &&
+                string->chars != string->inlineChars) {
+                FREE_ARRAY(char, string->chars, string->length + 1);
+            }
+            reallocate(object, stringSize(string), 0);
             break;
         }
         case OBJ_UPVALUE:
@@ -220,73 +450,683 @@ static void markRoots() {
         markObject((Obj*)upvalue);
     }
 
-    markTable(&vm.globals);
+    markTable(&vm.globalSlots);
+    markArray(&vm.globalValues);
     // to keep compiler module cleanly separated from the
     // rest of the VM, we handle in a separate function
     markCompilerRoots();
     markObject((Obj*)vm.initString);
+    markObject((Obj*)vm.gcStatsClass);
+    markObject((Obj*)vm.gcTypeStatsClass);
+}
+
+// Whether a full collection of the heap as it is now traces on threads.
+static bool marksInParallel() {
+#ifdef PARALLEL_MARK
+    return !vm.collectingYoung && vm.gcMarkThreads > 1 &&
+           vm.bytesAllocated >= vm.gcParallelMarkBytes;
+#else
+    return false;
+#endif
 }
 
 static void traceReferences() {
+#ifdef PARALLEL_MARK
+    if (marksInParallel()) {
+#ifdef DEBUG_LOG_GC
+        printf("-- parallel mark on %d threads\n", vm.gcMarkThreads);
+#endif
+        traceInParallel(vm.gcMarkThreads);
+        return;
+    }
+#endif
+
     while (vm.grayCount > 0) {
         Obj* object = vm.grayStack[--vm.grayCount];
         blackenObject(object);
     }
 }
 
-static void sweep() {
-    Obj* previous = NULL;
-    Obj* object = vm.objects;
+/*
+ * In a young collection, old objects that were written to since the last
+ * collection are roots: their young referents may be reachable through
+ * nothing else. A full collection just empties the set.
+ */
+static void markRemembered() {
+    for (int i = 0; i < vm.rememberedCount; i++) {
+        Obj* object = vm.remembered[i];
+        object->isRemembered = false;
+        if (vm.collectingYoung) blackenObject(object);
+    }
+    vm.rememberedCount = 0;
+}
+
+/*
+ * Frees the unmarked young objects and promotes the rest. Afterwards the
+ * nursery is empty, so no old object points at a young one and the
+ * remembered set can start over. A dead string is taken out of the intern
+ * table here, which spares a young collection from scanning all of it.
+ *
+ * Promoted objects stay marked until the next full collection clears the
+ * bitmaps, so a sweep that's underway leaves them alone.
+ */
+static void sweepYoung() {
+    Obj* object = vm.youngObjects;
     while (object != NULL) {
-        if (object->isMarked) {
-            // when next collection cycle starts, we
-            // need every object to be white.
-            object->isMarked = false;
-            previous = object;
-            object = object->next;
+        Obj* next = object->next;
+        if (isMarked(object)) {
+            object->isOld = true;
         } else {
-            Obj* unreached = object;
-            object = object->next;
-            if (previous != NULL) {
-                previous->next = object;
-            } else {
-                vm.objects = object;
+            if (object->type == OBJ_STRING &&
+                ((ObjString*)object)->isInterned) {
+                tableDelete(&vm.strings, (ObjString*)object);
+            }
+            countDeadObject(object);
+            freeObject(object);
+        }
+        object = next;
+    }
+    vm.youngObjects = NULL;
+    // The sweeper's place in the page list has to stay put until it's done.
+    if (vm.gcPhase != GC_SWEEP) releaseEmptyPages(&vm.heap);
+}
+
+/*
+ * Starts a full collection. This only grays the roots; the tracing is left
+ * to markSlice(), a little at a time. A heap big enough to mark in parallel
+ * is instead marked right away, in one pause with every thread on it.
+ */
+static void beginCycle() {
+#ifdef DEBUG_LOG_GC
+    printf("-- gc begin\n");
+#endif
+
+    beginPause();
+    vm.gcStats.fullCollections++;
+    vm.gcPhase = GC_MARK;
+    clearMarkBits(&vm.heap);
+    markRoots();
+    if (marksInParallel()) finishCycle();
+    endPause();
+}
+
+/*
+ * Ends the marking. The dead old objects are left unmarked until
+ * sweepSlice() gets to them, a little at a time, so the next cycle can't
+ * start before it's done and clears the mark bits.
+ */
+static void finishCycle() {
+    // Stores into the stack, globals and other roots don't go through the
+    // barrier, so look at them again before calling anything garbage.
+    markRoots();
+    markRemembered();
+    traceReferences();
+
+    sweepYoung();
+    vm.gcPhase = GC_SWEEP;
+    // Pages added from here on are at the head of the list, behind it.
+    vm.sweepPage = vm.heap.pages;
+    vm.nextYoungGC = vm.bytesAllocated + NURSERY_SIZE;
+#ifdef CONCURRENT_SWEEP
+    if (vm.gcSweepInBackground) startSweeper();
+#endif
+
+#ifdef DEBUG_LOG_GC
+    printf("-- gc mark end\n");
+#endif
+}
+
+/*
+ * One increment of marking, run from an allocation. Young collections wait
+ * until the marking is over since they share the mark bits with it, and it
+ * ends with the nursery swept anyway.
+ */
+static void markSlice() {
+    beginPause();
+    int work = 0;
+    while (vm.grayCount > 0 &&
+           (vm.gcSliceBudget <= 0 || work < vm.gcSliceBudget)) {
+        work += blackenObject(vm.grayStack[--vm.grayCount]);
+    }
+
+    if (vm.grayCount == 0) finishCycle();
+    endPause();
+}
+
+/*
+ * Frees the unmarked old objects on `page`, found from its bitmaps without
+ * touching the live ones. An unmarked young object was allocated after the
+ * marking ended and is left for a young collection. Returns the work done,
+ * one unit per bitmap word and per object freed.
+ */
+static int sweepPage(HeapPage* page) {
+    int work = HEAP_BITMAP_WORDS;
+    for (int i = 0; i < HEAP_BITMAP_WORDS; i++) {
+        uint64_t unmarked = page->objectBits[i] & ~page->markBits[i];
+        while (unmarked != 0) {
+            Obj* object = (Obj*)HEAP_BLOCK_AT(page, i, lowestBit(unmarked));
+            unmarked &= unmarked - 1;
+            if (!object->isOld) continue;
+
+            if (object->type == OBJ_STRING &&
+                ((ObjString*)object)->isInterned) {
+                tableDelete(&vm.strings, (ObjString*)object);
+            }
+            countDeadObject(object);
+            freeObject(object);
+            work++;
+        }
+    }
+    return work;
+}
+
+#ifdef CONCURRENT_SWEEP
+// Blocks from libc can go straight back. Ones on heap pages need the lock.
+static void deferFree(void* block, size_t size) {
+    if (size > HEAP_MAX_SMALL) {
+        heapReallocate(&vm.heap, block, size, 0);
+        return;
+    }
+
+    if (pendingCapacity < pendingCount + 1) {
+        pendingCapacity = GROW_CAPACITY(pendingCapacity);
+        pendingBlocks = (void**)realloc(pendingBlocks,
+                                        sizeof(void*) * pendingCapacity);
+        pendingSizes = (size_t*)realloc(pendingSizes,
+                                        sizeof(size_t) * pendingCapacity);
+        if (pendingBlocks == NULL || pendingSizes == NULL) exit(1);
+    }
+    pendingBlocks[pendingCount] = block;
+    pendingSizes[pendingCount] = size;
+    pendingCount++;
+}
+
+/*
+ * sweepPage() for the sweeper thread, minus the freeing: it only lists the
+ * dead objects, and takes the dead strings out of the intern table so
+ * nothing can revive them after.
+ */
+static void findDeadObjects(HeapPage* page) {
+    for (int i = 0; i < HEAP_BITMAP_WORDS; i++) {
+        uint64_t unmarked = page->objectBits[i] & ~page->markBits[i];
+        while (unmarked != 0) {
+            Obj* object = (Obj*)HEAP_BLOCK_AT(page, i, lowestBit(unmarked));
+            unmarked &= unmarked - 1;
+            if (!object->isOld) continue;
+
+            if (object->type == OBJ_STRING &&
+                ((ObjString*)object)->isInterned) {
+                tableDelete(&vm.strings, (ObjString*)object);
+            }
+            countDeadObject(object);
+            if (deadCapacity < deadCount + 1) {
+                deadCapacity = GROW_CAPACITY(deadCapacity);
+                deadObjects = (Obj**)realloc(deadObjects,
+                                             sizeof(Obj*) * deadCapacity);
+                if (deadObjects == NULL) exit(1);
             }
+            deadObjects[deadCount++] = object;
+        }
+    }
+}
+
+/*
+ * Sweeps a page at a time, holding the heap lock only to read its bitmaps
+ * and to put the freed blocks back. In between, the dead objects are taken
+ * apart without it, since nothing else can reach them any more.
+ */
+static void* runSweeper(void* unused) {
+    isSweeperThread = true;
+    for (;;) {
+        pthread_mutex_lock(&heapLock);
+        HeapPage* page = vm.sweepPage;
+        if (page != NULL) {
+            findDeadObjects(page);
+            vm.sweepPage = page->next;
+        }
+        pthread_mutex_unlock(&heapLock);
+
+        if (page == NULL) break;
+
+        for (int i = 0; i < deadCount; i++) {
+            freeObject(deadObjects[i]);
+        }
+        deadCount = 0;
+
+        pthread_mutex_lock(&heapLock);
+        for (int i = 0; i < pendingCount; i++) {
+            heapReallocate(&vm.heap, pendingBlocks[i], pendingSizes[i], 0);
+        }
+        pthread_mutex_unlock(&heapLock);
+        pendingCount = 0;
+    }
+
+    free(deadObjects);
+    free(pendingBlocks);
+    free(pendingSizes);
+    deadObjects = NULL;
+    pendingBlocks = NULL;
+    pendingSizes = NULL;
+    deadCapacity = 0;
+    pendingCapacity = 0;
+
+    __atomic_store_n(&sweeperDone, true, __ATOMIC_RELEASE);
+    return NULL;
+}
+
+/*
+ * Hands the sweep to a thread of its own. If the VM is partway through a
+ * heap operation, it takes the lock first, since the rest of it can't
+ * overlap the sweeper. If no thread can be started, the sweep goes on a
+ * slice at a time.
+ */
+static void startSweeper() {
+    sweeperDone = false;
+    sweptBytes = 0;
+    // Set first, since reallocate() on the sweeper checks it.
+    vm.sweeperRunning = true;
+    if (vm.heapLockDepth > 0) acquireHeapLock();
+
+    if (pthread_create(&sweeperThread, NULL, runSweeper, NULL) != 0) {
+        vm.sweeperRunning = false;
+        if (vm.heapLockTaken) releaseHeapLock();
+    }
+}
+
+static void joinSweeper() {
+    // It may be waiting on the lock to finish its last page.
+    if (vm.heapLockTaken) releaseHeapLock();
+    pthread_join(sweeperThread, NULL);
+
+    vm.sweeperRunning = false;
+    vm.bytesAllocated -= sweptBytes;
+    vm.gcStats.bytesFreed += sweptBytes;
+}
+#endif
+
+/*
+ * Sweeps pages until `budget` units of work are done, or all of them if
+ * it's zero or less. Objects promoted meanwhile are marked, so it leaves
+ * them alone. With a sweeper thread on it, this only checks whether it's
+ * done.
+ */
+static void sweepSlice(int budget) {
+#ifdef DEBUG_LOG_GC
+    size_t before = vm.bytesAllocated;
+#endif
 
-            freeObject(unreached);
+#ifdef CONCURRENT_SWEEP
+    if (vm.sweeperRunning) {
+        if (!__atomic_load_n(&sweeperDone, __ATOMIC_ACQUIRE)) return;
+        joinSweeper();
+    }
+#endif
+
+    beginPause();
+    int work = 0;
+    while (vm.sweepPage != NULL && (budget <= 0 || work < budget)) {
+        work += sweepPage(vm.sweepPage);
+        vm.sweepPage = vm.sweepPage->next;
+    }
+
+#ifdef DEBUG_LOG_GC
+    printf("   swept %zu bytes\n", before - vm.bytesAllocated);
+#endif
+
+    if (vm.sweepPage == NULL) {
+        vm.gcPhase = GC_IDLE;
+        releaseEmptyPages(&vm.heap);
+        // A full collection is rare enough to give pages back to the OS.
+        trimHeap(&vm.heap);
+        endPause();
+        vm.nextGC = nextGCThreshold(&vm.gcPolicy, vm.bytesAllocated);
+#ifdef COMPACTING_GC
+        if (heapOccupancy(&vm.heap) < vm.gcCompactOccupancy) {
+            vm.compactRequested = true;
         }
+#endif
+
+#ifdef DEBUG_LOG_GC
+        printf("-- gc end\n");
+        printf("   %zu bytes in use on %d pages, next at %zu\n",
+               vm.bytesAllocated, vm.heap.pageCount, vm.nextGC);
+#endif
+        return;
     }
+    endPause();
 }
 
+// Finishes the sweep underway, if any, waiting for the sweeper thread.
+void completeSweep() {
+    if (vm.gcPhase != GC_SWEEP) return;
+#ifdef CONCURRENT_SWEEP
+    if (vm.sweeperRunning) joinSweeper();
+#endif
+    sweepSlice(0);
+}
+
+/*
+ * Puts `policy` in charge of full collections. The next one is due once
+ * the heap reaches its initial size, so call this before running code.
+ */
+void setGCPolicy(GCPolicy* policy) {
+    vm.gcPolicy = *policy;
+    vm.nextGC = policy->initialHeap;
+}
+
+/*
+ * Copies out the GC stats. A sweeper thread counts what it frees as it
+ * goes, but the bytes only once the VM has joined it.
+ */
+void readGCStats(GCStats* stats) {
+    lockHeap();
+    *stats = vm.gcStats;
+    unlockHeap();
+}
+
+// Runs a full collection to the end, finishing one already underway.
 void collectGarbage() {
+    beginPause();
+    completeSweep();
+    if (vm.gcPhase == GC_IDLE) beginCycle();
+    if (vm.gcPhase == GC_MARK) finishCycle();
+    completeSweep();
+    endPause();
+}
+
+static void collectYoungGarbage() {
 #ifdef DEBUG_LOG_GC
-    printf("-- gc begin\n");
+    printf("-- young gc begin\n");
     size_t before = vm.bytesAllocated;
 #endif
 
+    // Promoting and freeing young objects both change the bitmaps that a
+    // sweeper thread reads.
+    beginPause();
+    lockHeap();
+    vm.gcStats.youngCollections++;
+    vm.collectingYoung = true;
     markRoots();
+    markRemembered();
     traceReferences();
-    tableRemoveWhite(&vm.strings);
-    sweep();
+    sweepYoung();
+    vm.collectingYoung = false;
+    unlockHeap();
+    endPause();
 
-    vm.nextGC = vm.bytesAllocated * GC_HEAP_GROW_FACTOR;
+    vm.nextYoungGC = vm.bytesAllocated + NURSERY_SIZE;
 
 #ifdef DEBUG_LOG_GC
-    printf("-- gc end\n");
-    printf("   collected %zu bytes (from %zu to %zu) next at %zu\n",
-           before - vm.bytesAllocated, before, vm.bytesAllocated,
-           vm.nextGC);
+    printf("-- young gc end\n");
+    printf("   collected %zu bytes (from %zu to %zu)\n",
+           before - vm.bytesAllocated, before, vm.bytesAllocated);
+#endif
+}
+
+/*
+ * Compaction copies the objects on sparse pages to fuller ones, rewrites
+ * every reference to them and gives the emptied pages back to the OS. An
+ * evacuated object keeps the address it moved to in `next`, which only a
+ * young object uses otherwise.
+ */
+static Obj* forward(Obj* object) {
+    if (object != NULL && HEAP_PAGE_OF(object)->isEvacuating) {
+        return object->next;
+    }
+    return object;
+}
+
+static void forwardValue(Value* value) {
+    if (IS_OBJ(*value)) *value = OBJ_VAL(forward(AS_OBJ(*value)));
+}
+
+// Moves a block that isn't an object off an evacuated page.
+static void* relocate(void* block, size_t size) {
+    if (block == NULL || size > HEAP_MAX_SMALL ||
+        !HEAP_PAGE_OF(block)->isEvacuating) {
+        return block;
+    }
+    void* moved = heapReallocate(&vm.heap, NULL, 0, size);
+    // A half-moved heap can't be unwound.
+    if (moved == NULL) exit(1);
+    memcpy(moved, block, size);
+    return moved;
+}
+
+static void fixArray(ValueArray* array) {
+    array->values = relocate(array->values, sizeof(Value) * array->capacity);
+    for (int i = 0; i < array->count; i++) {
+        forwardValue(&array->values[i]);
+    }
+}
+
+static void fixTable(Table* table) {
+    table->entries = relocate(table->entries,
+                              tableBlockSize(table->capacity));
+    for (int i = 0; i < table->capacity; i++) {
+        Entry* entry = &table->entries[i];
+        entry->key = (ObjString*)forward((Obj*)entry->key);
+        forwardValue(&entry->value);
+    }
+}
+
+static void fixChunk(Chunk* chunk) {
+    chunk->code = relocate(chunk->code, chunk->capacity);
+    chunk->lines = relocate(chunk->lines, sizeof(int) * chunk->capacity);
+    fixArray(&chunk->constants);
+    chunk->caches = relocate(chunk->caches,
+                             sizeof(InlineCache) * chunk->cacheCapacity);
+    for (int i = 0; i < chunk->cacheCount; i++) {
+        for (int j = 0; j < INLINE_CACHE_WAYS; j++) {
+            CacheWay* way = &chunk->caches[i].ways[j];
+            way->shape = forward(way->shape);
+            way->target = forward(way->target);
+        }
+    }
+}
+
+/*
+ * Points everything `object` refers to at where it lives now, and moves
+ * the arrays it owns off evacuated pages. Mirrors blackenObject() and
+ * freeObject(), which is where a new field needs handling too.
+ */
+static void fixObject(Obj* object) {
+    switch (object->type) {
+        case OBJ_BOUND_METHOD: {
+            ObjBoundMethod* bound = (ObjBoundMethod*)object;
+            forwardValue(&bound->receiver);
+            bound->method = (ObjClosure*)forward((Obj*)bound->method);
+            break;
+        }
+        case OBJ_CLASS: {
+            ObjClass* klass = (ObjClass*)object;
+            klass->name = (ObjString*)forward((Obj*)klass->name);
+            fixTable(&klass->methods);
+            klass->shape = (ObjShape*)forward((Obj*)klass->shape);
+            break;
+        }
+        case OBJ_CLOSURE: {
+            ObjClosure* closure = (ObjClosure*)object;
+            closure->function =
+                    (ObjFunction*)forward((Obj*)closure->function);
+            closure->upvalues = relocate(
+                    closure->upvalues,
+                    sizeof(ObjUpvalue*) * closure->upvalueCount);
+            for (int i = 0; i < closure->upvalueCount; i++) {
+                closure->upvalues[i] =
+                        (ObjUpvalue*)forward((Obj*)closure->upvalues[i]);
+            }
+            break;
+        }
+        case OBJ_FUNCTION: {
+            ObjFunction* function = (ObjFunction*)object;
+            function->name = (ObjString*)forward((Obj*)function->name);
+            fixChunk(&function->chunk);
+            break;
+        }
+        case OBJ_INSTANCE: {
+            ObjInstance* instance = (ObjInstance*)object;
+            instance->klass = (ObjClass*)forward((Obj*)instance->klass);
+            instance->shape = (ObjShape*)forward((Obj*)instance->shape);
+            if (instance->fields != instance->inlineFields) {
+                instance->fields = relocate(
+                        instance->fields, sizeof(Value) * instance->capacity);
+            }
+            for (int i = 0; i < instance->shape->fieldCount; i++) {
+                forwardValue(&instance->fields[i]);
+            }
+            break;
+        }
+        case OBJ_SHAPE: {
+            ObjShape* shape = (ObjShape*)object;
+            fixTable(&shape->slots);
+            fixTable(&shape->transitions);
+            break;
+        }
+        case OBJ_STRING: {
+            ObjString* string = (ObjString*)object;
+            if (string->chars != string->inlineChars) {
+                string->chars = relocate(string->chars, string->length + 1);
+            }
+            string->left = (ObjString*)forward((Obj*)string->left);
+            string->right = (ObjString*)forward((Obj*)string->right);
+            break;
+        }
+        case OBJ_UPVALUE: {
+            ObjUpvalue* upvalue = (ObjUpvalue*)object;
+            forwardValue(&upvalue->closed);
+            upvalue->next = (ObjUpvalue*)forward((Obj*)upvalue->next);
+            break;
+        }
+        case OBJ_NATIVE:
+            break;
+    }
+}
+
+static void evacuatePage(HeapPage* page) {
+    size_t size = HEAP_BLOCK_SIZE(page);
+    for (int i = 0; i < HEAP_BITMAP_WORDS; i++) {
+        uint64_t objects = page->objectBits[i];
+        while (objects != 0) {
+            Obj* object = (Obj*)HEAP_BLOCK_AT(page, i, lowestBit(objects));
+            objects &= objects - 1;
+
+            Obj* moved = (Obj*)heapReallocate(&vm.heap, NULL, 0, size);
+            if (moved == NULL) exit(1);
+            memcpy(moved, object, size);
+            tagObjectBlock(moved);
+            setMarked(moved);
+
+            // Pointers into the object itself have to move with it.
+            if (object->type == OBJ_UPVALUE) {
+                ObjUpvalue* upvalue = (ObjUpvalue*)object;
+                if (upvalue->location == &upvalue->closed) {
+                    ((ObjUpvalue*)moved)->location =
+                            &((ObjUpvalue*)moved)->closed;
+                }
+            } else if (object->type == OBJ_INSTANCE) {
+                ObjInstance* instance = (ObjInstance*)object;
+                if (instance->fields == instance->inlineFields) {
+                    ((ObjInstance*)moved)->fields =
+                            ((ObjInstance*)moved)->inlineFields;
+                }
+            } else if (object->type == OBJ_STRING) {
+                ObjString* string = (ObjString*)object;
+                if (string->chars == string->inlineChars) {
+                    ((ObjString*)moved)->chars =
+                            ((ObjString*)moved)->inlineChars;
+                }
+            }
+            object->next = moved;
+        }
+    }
+}
+
+/*
+ * Collects, then compacts the sparse pages. Only the VM's roots are
+ * updated, so the caller must hold no heap pointer in a C local and no
+ * compiler may be running. run() calls this at its safe points once a
+ * full collection has asked for it.
+ */
+void compactHeap() {
+    collectGarbage();
+    vm.compactRequested = false;
+
+#ifdef DEBUG_LOG_GC
+    printf("-- compact begin\n");
+    int before = vm.heap.pageCount;
+#endif
+
+    if (selectEvacuationPages(&vm.heap, vm.gcCompactOccupancy) == 0) return;
+    beginPause();
+    vm.gcStats.compactions++;
+
+    // Each frame's ip points into its function's code, which may move.
+    ptrdiff_t ipOffsets[FRAMES_MAX];
+    for (int i = 0; i < vm.frameCount; i++) {
+        CallFrame* frame = &vm.frames[i];
+        ipOffsets[i] = frame->ip - frame->closure->function->chunk.code;
+    }
+
+    for (HeapPage* page = vm.heap.pages; page != NULL; page = page->next) {
+        if (page->isEvacuating) evacuatePage(page);
+    }
+
+    for (Value* slot = vm.stack; slot < vm.stackTop; slot++) {
+        forwardValue(slot);
+    }
+    for (int i = 0; i < vm.frameCount; i++) {
+        vm.frames[i].closure =
+                (ObjClosure*)forward((Obj*)vm.frames[i].closure);
+    }
+    vm.openUpvalues = (ObjUpvalue*)forward((Obj*)vm.openUpvalues);
+    fixTable(&vm.globalSlots);
+    fixArray(&vm.globalNames);
+    fixArray(&vm.globalValues);
+    fixTable(&vm.strings);
+    vm.initString = (ObjString*)forward((Obj*)vm.initString);
+    vm.gcStatsClass = (ObjClass*)forward((Obj*)vm.gcStatsClass);
+    vm.gcTypeStatsClass = (ObjClass*)forward((Obj*)vm.gcTypeStatsClass);
+
+    // This walks the copies too. Pages added meanwhile hold no objects.
+    for (HeapPage* page = vm.heap.pages; page != NULL; page = page->next) {
+        if (page->isEvacuating) continue;
+        for (int i = 0; i < HEAP_BITMAP_WORDS; i++) {
+            uint64_t objects = page->objectBits[i];
+            while (objects != 0) {
+                fixObject((Obj*)HEAP_BLOCK_AT(page, i, lowestBit(objects)));
+                objects &= objects - 1;
+            }
+        }
+    }
+
+    for (int i = 0; i < vm.frameCount; i++) {
+        CallFrame* frame = &vm.frames[i];
+        frame->ip = frame->closure->function->chunk.code + ipOffsets[i];
+    }
+
+    releaseEvacuatedPages(&vm.heap);
+    endPause();
+
+#ifdef DEBUG_LOG_GC
+    printf("-- compact end\n");
+    printf("   %d pages down to %d\n", before, vm.heap.pageCount);
 #endif
 }
 
 void freeObjects() {
-    Obj* object = vm.objects;
-    while (object != NULL) {
-        Obj* next = object->next;
-        freeObject(object);
-        object = next;
+    for (HeapPage* page = vm.heap.pages; page != NULL; page = page->next) {
+        for (int i = 0; i < HEAP_BITMAP_WORDS; i++) {
+            uint64_t objects = page->objectBits[i];
+            while (objects != 0) {
+                freeObject((Obj*)HEAP_BLOCK_AT(page, i, lowestBit(objects)));
+                objects &= objects - 1;
+            }
+        }
     }
+    vm.youngObjects = NULL;
 
     // free gray stack when VM shuts down
     free(vm.grayStack);
+    free(vm.remembered);
 }
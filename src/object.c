@@ -3,8 +3,10 @@
 //
 
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 
+#include "hash.h"
 #include "memory.h"
 #include "object.h"
 #include "table.h"
@@ -14,13 +16,53 @@
 #define ALLOCATE_OBJ(type, objectType) \
     (type*)allocateObject(sizeof(type), objectType)
 
+// The most fields that still leave an instance small enough for a size
+// class. That's fewer without NaN boxing, as a Value is twice the size.
+#define MAX_HEAP_INLINE_FIELDS \
+    ((int)((HEAP_MAX_SMALL - sizeof(ObjInstance)) / sizeof(Value)))
+
+// Past this many fields an instance keeps growing out of line rather than
+// making every later instance of its class reserve that much inline.
+#define MAX_INLINE_FIELDS \
+    (MAX_HEAP_INLINE_FIELDS < 16 ? MAX_HEAP_INLINE_FIELDS : 16)
+
+/*
+ * Objects have to live on heap pages, since marking and compaction find a
+ * block's page by masking its address, so each one, with what it holds
+ * inline, has to fit the largest size class. C99 has no static assert, so
+ * a failed check here is an array of negative size.
+ */
+#define ASSERT_FITS_SIZE_CLASS(name, size) \
+    typedef char name##FitsSizeClass[(size) <= HEAP_MAX_SMALL ? 1 : -1]
+
+ASSERT_FITS_SIZE_CLASS(boundMethod, sizeof(ObjBoundMethod));
+ASSERT_FITS_SIZE_CLASS(class, sizeof(ObjClass));
+ASSERT_FITS_SIZE_CLASS(closure, sizeof(ObjClosure));
+ASSERT_FITS_SIZE_CLASS(function, sizeof(ObjFunction));
+ASSERT_FITS_SIZE_CLASS(instance, sizeof(ObjInstance) +
+                                 sizeof(Value) * MAX_INLINE_FIELDS);
+ASSERT_FITS_SIZE_CLASS(native, sizeof(ObjNative));
+ASSERT_FITS_SIZE_CLASS(shape, sizeof(ObjShape));
+ASSERT_FITS_SIZE_CLASS(string, STRING_HEADER_SIZE + MAX_INLINE_CHARS + 1);
+ASSERT_FITS_SIZE_CLASS(upvalue, sizeof(ObjUpvalue));
+
 static Obj* allocateObject(size_t size, ObjType type) {
+    // A sweeper thread must not see the block tagged before its header is.
+    lockHeap();
     Obj* object = (Obj*) reallocate(NULL, 0, size);
+    // Every object fits a size class, see above, so it's on a heap page.
+    tagObjectBlock(object);
     object->type = type;
-    object->isMarked = false;
+    object->isOld = false;
+    object->isRemembered = false;
+    // Frees are counted by a sweeper thread too, under the same lock.
+    vm.gcStats.objectsAllocated[type]++;
+    vm.gcStats.objectBytesAllocated[type] += size;
+    unlockHeap();
 
-    object->next = vm.objects;
-    vm.objects = object;
+    // Every object starts out young.
+    object->next = vm.youngObjects;
+    vm.youngObjects = object;
 
 #ifdef DEBUG_LOG_GC
     printf("%p allocate %zu for %d\n", (void*)object, size, type);
@@ -36,10 +78,25 @@ ObjBoundMethod* newBoundMethod(Value receiver, ObjClosure* method) {
     return bound;
 }
 
+static ObjShape* newShape() {
+    ObjShape* shape = ALLOCATE_OBJ(ObjShape, OBJ_SHAPE);
+    initTable(&shape->slots);
+    initTable(&shape->transitions);
+    shape->fieldCount = 0;
+    return shape;
+}
+
 ObjClass* newClass(ObjString* name) {
     ObjClass* klass = ALLOCATE_OBJ(ObjClass, OBJ_CLASS);
     klass->name = name;
     initTable(&klass->methods);
+    klass->shape = NULL;
+    klass->fieldHint = 0;
+
+    push(OBJ_VAL(klass));
+    klass->shape = newShape();
+    writeBarrier((Obj*)klass, OBJ_VAL(klass->shape));
+    pop();
     return klass;
 }
 
@@ -61,18 +118,92 @@ ObjFunction* newFunction() {
     ObjFunction* function = ALLOCATE_OBJ(ObjFunction, OBJ_FUNCTION);
     function->arity = 0;
     function->upvalueCount = 0;
+    function->slotCount = 0;
     function->name = NULL;
     initChunk(&function->chunk);
     return function;
 }
 
 ObjInstance* newInstance(ObjClass* klass) {
-    ObjInstance* instance = ALLOCATE_OBJ(ObjInstance, OBJ_INSTANCE);
+    int inlineCapacity = klass->fieldHint;
+    ObjInstance* instance = (ObjInstance*)allocateObject(
+            sizeof(ObjInstance) + sizeof(Value) * inlineCapacity,
+            OBJ_INSTANCE);
     instance->klass = klass;
-    initTable(&instance->fields);
+    instance->shape = klass->shape;
+    instance->fields = instance->inlineFields;
+    instance->capacity = inlineCapacity;
+    instance->inlineCapacity = inlineCapacity;
     return instance;
 }
 
+int shapeSlot(ObjShape* shape, ObjString* name) {
+    Value slot;
+    if (!tableGet(&shape->slots, name, &slot)) return -1;
+    return (int)AS_NUMBER(slot);
+}
+
+ObjShape* shapeTransition(ObjShape* shape, ObjString* name) {
+    Value next;
+    if (tableGet(&shape->transitions, name, &next)) return AS_SHAPE(next);
+
+    ObjShape* child = newShape();
+    push(OBJ_VAL(child));
+    tableAddAll(&shape->slots, &child->slots);
+    tableSet(&child->slots, name, NUMBER_VAL(shape->fieldCount));
+    // Growing the tables can collect, so even `child` may be old by now.
+    writeBarrierAll((Obj*)child);
+    child->fieldCount = shape->fieldCount + 1;
+    tableSet(&shape->transitions, name, OBJ_VAL(child));
+    writeBarrier((Obj*)shape, OBJ_VAL(child));
+    writeBarrier((Obj*)shape, OBJ_VAL(name));
+    pop();
+    return child;
+}
+
+bool getField(ObjInstance* instance, ObjString* name, Value* value) {
+    int slot = shapeSlot(instance->shape, name);
+    if (slot == -1) return false;
+
+    *value = instance->fields[slot];
+    return true;
+}
+
+// The instance and value must be reachable by the GC; both the
+// transition and growing the field array can allocate.
+int addField(ObjInstance* instance, ObjString* name, Value value) {
+    ObjShape* shape = shapeTransition(instance->shape, name);
+    int slot = shape->fieldCount - 1;
+
+    if (slot >= instance->capacity) {
+        int oldCapacity = instance->capacity;
+        int capacity = GROW_CAPACITY(oldCapacity);
+        if (instance->fields == instance->inlineFields) {
+            Value* fields = ALLOCATE(Value, capacity);
+            memcpy(fields, instance->inlineFields,
+                   sizeof(Value) * oldCapacity);
+            instance->fields = fields;
+        } else {
+            instance->fields = GROW_ARRAY(Value, instance->fields,
+                                          oldCapacity, capacity);
+        }
+        instance->capacity = capacity;
+
+        ObjClass* klass = instance->klass;
+        if (klass->fieldHint < shape->fieldCount &&
+            klass->fieldHint < MAX_INLINE_FIELDS) {
+            klass->fieldHint = shape->fieldCount < MAX_INLINE_FIELDS
+                    ? shape->fieldCount : MAX_INLINE_FIELDS;
+        }
+    }
+
+    instance->fields[slot] = value;
+    instance->shape = shape;
+    writeBarrier((Obj*)instance, value);
+    writeBarrier((Obj*)instance, OBJ_VAL(shape));
+    return slot;
+}
+
 ObjNative* newNative(NativeFn function) {
     ObjNative* native = ALLOCATE_OBJ(ObjNative, OBJ_NATIVE);
     native->function = function;
@@ -80,45 +211,89 @@ ObjNative* newNative(NativeFn function) {
 }
 
 //static ObjString* allocateString(char* chars, int length) {
-static ObjString* allocateString(char* chars, int length,
-                                 uint32_t hash) {
-    ObjString* string = ALLOCATE_OBJ(ObjString, OBJ_STRING);
+/*
+ * A new string of `chars`, not interned yet. A short one copies them into
+ * the object and frees `owned`, if it was given the buffer they're in. A
+ * long one keeps `owned`, or copies them to a buffer of its own.
+ */
+static ObjString* allocateString(const char* chars, char* owned, int length) {
+    bool isInline = length <= MAX_INLINE_CHARS;
+    if (!isInline && owned == NULL) {
+        owned = ALLOCATE(char, length + 1);
+        memcpy(owned, chars, length);
+        owned[length] = '\0';
+    }
+
+    ObjString* string = (ObjString*)allocateObject(
+            STRING_HEADER_SIZE + (isInline ? length + 1 : 0), OBJ_STRING);
     string->length = length;
-    string->chars = chars;
-    string->hash = hash;
+    string->hash = 0;
+    string->left = NULL;
+    string->right = NULL;
+    string->isInterned = false;
+    if (isInline) {
+        string->chars = string->inlineChars;
+        memcpy(string->chars, chars, length);
+        string->chars[length] = '\0';
+        if (owned != NULL) FREE_ARRAY(char, owned, length + 1);
+    } else {
+        string->chars = owned;
+    }
+    return string;
+}
 
+static void addInterned(ObjString* string, uint32_t hash) {
+    string->hash = hash;
+    string->isInterned = true;
     push(OBJ_VAL(string));
     /*
      * Some langs have a separate type or an explicit step to intern a string
-     * For clox, we automatically intern every one. which means whenever we
-     * create a new unique string, we add it to the table
+     * For clox, we intern every short one as it's made, and a long one once
+     * it's used as a key, see internString()
      */
     tableSet(&vm.strings, string, NIL_VAL);
     pop();
-    return string;
 }
 
-static uint32_t hashString(const char* key, int length) {
-    uint32_t hash = 2166136261u;
-    for (int i = 0; i < length; i++) {
-        hash ^= (uint8_t)key[i];
-        hash *= 16777619;
+/*
+ * While the old generation is being swept, the intern table can still hold
+ * dead strings the sweeper hasn't reached. A string points at nothing, so
+ * one can be brought back just by marking it. Interning holds the heap
+ * lock, since a sweeper thread deletes from the table.
+ */
+static ObjString* reviveString(ObjString* string) {
+    if (vm.gcPhase == GC_SWEEP && string->obj.isOld &&
+        !isMarked(&string->obj)) {
+        setMarked(&string->obj);
     }
-    return hash;
+    return string;
 }
 
 ObjString* takeString(char* chars, int length) {
+    if (length >= UNINTERNED_MIN_LENGTH) {
+        return allocateString(chars, chars, length);
+    }
+
     uint32_t hash = hashString(chars, length);
-    ObjString* interned = tableFindString(&vm.strings, chars, length, hash);
+    lockHeap();
+    ObjString* string = tableFindString(&vm.strings, chars, length, hash);
 
-    if (interned != NULL) {
+    if (string != NULL) {
         FREE_ARRAY(char, chars, length + 1);
-        return interned;
+        reviveString(string);
+    } else {
+        string = allocateString(chars, chars, length);
+        addInterned(string, hash);
     }
-    return allocateString(chars, length, hash);
+    unlockHeap();
+    return string;
 }
 
 ObjString* copyString(const char* chars, int length) {
+    if (length >= UNINTERNED_MIN_LENGTH) {
+        return allocateString(chars, NULL, length);
+    }
+
     uint32_t hash = hashString(chars, length);
     /*
      * we need to check for duplicate before we get here.
@@ -128,14 +303,117 @@ ObjString* copyString(const char* chars, int length) {
      * if found, instead of copying, we just return a reference to that string.
      * otherwise, we fall through, allocate new string and store it in the string table
      */
-    ObjString* interned = tableFindString(&vm.strings, chars, length, hash);
-    if (interned != NULL) return interned;
+    lockHeap();
+    ObjString* string = tableFindString(&vm.strings, chars, length, hash);
+    if (string != NULL) {
+        reviveString(string);
+    } else {
+        string = allocateString(chars, NULL, length);
+        addInterned(string, hash);
+    }
+    unlockHeap();
+    return string;
+}
+
+/*
+ * The interned string equal to `string`, which becomes it if there isn't
+ * one yet. Anything used as a table key has to go through here, since
+ * tables compare keys by identity. Interning a rope flattens it, so the
+ * caller must keep `string` reachable.
+ */
+ObjString* internString(ObjString* string) {
+    if (string->isInterned) return string;
+
+    flattenString(string);
+    uint32_t hash = hashString(string->chars, string->length);
+    lockHeap();
+    ObjString* interned = tableFindString(&vm.strings, string->chars,
+                                          string->length, hash);
+    if (interned != NULL) {
+        reviveString(interned);
+    } else {
+        interned = string;
+        addInterned(string, hash);
+    }
+    unlockHeap();
+    return interned;
+}
+
+/*
+ * Copies the characters of `string`, rope or not, to `chars`. Recursing
+ * only into the shorter side of each rope keeps the C stack no deeper than
+ * log2 of the length, however lopsided the rope is.
+ */
+static void copyChars(ObjString* string, char* chars) {
+    while (string->chars == NULL) {
+        ObjString* left = string->left;
+        ObjString* right = string->right;
+        if (left->length < right->length) {
+            copyChars(left, chars);
+            chars += left->length;
+            string = right;
+        } else {
+            copyChars(right, chars + left->length);
+            string = left;
+        }
+    }
+    memcpy(chars, string->chars, string->length);
+}
+
+/*
+ * The string `a` followed by `b`, which the caller must keep reachable.
+ * A long result is a rope over the two, a short one is copied, with its
+ * characters inline. Either way it isn't interned: most results are
+ * printed or thrown away, never used as a key.
+ */
+ObjString* concatenateStrings(ObjString* a, ObjString* b) {
+    if (a->length == 0) return b;
+    if (b->length == 0) return a;
+
+    int length = a->length + b->length;
+    if (length < ROPE_MIN_LENGTH) {
+        char chars[ROPE_MIN_LENGTH];
+        copyChars(a, chars);
+        copyChars(b, chars + a->length);
+        return allocateString(chars, NULL, length);
+    }
+
+    ObjString* string = (ObjString*)allocateObject(STRING_HEADER_SIZE,
+                                                   OBJ_STRING);
+    string->length = length;
+    string->hash = 0;
+    string->chars = NULL;
+    string->left = a;
+    string->right = b;
+    string->isInterned = false;
+    return string;
+}
+
+/*
+ * Gives a rope its characters, and lets go of the strings it was made of.
+ * This allocates, so the caller must keep `string` reachable.
+ */
+void flattenString(ObjString* string) {
+    if (string->chars != NULL) return;
+
+    char* chars = ALLOCATE(char, string->length + 1);
+    copyChars(string, chars);
+    chars[string->length] = '\0';
+    string->chars = chars;
+    string->left = NULL;
+    string->right = NULL;
+}
+
+// Compares by content unless both are interned. This can flatten them.
+bool stringsEqual(ObjString* a, ObjString* b) {
+    if (a == b) return true;
+    if ((a->isInterned && b->isInterned) || a->length != b->length) {
+        return false;
+    }
 
-    char* heapChars = ALLOCATE(char, length + 1);
-    memcpy(heapChars, chars, length);
-    heapChars[length] = '\0';
-//    return allocateString(heapChars, length);
-    return allocateString(chars, length, hash);
+    flattenString(a);
+    flattenString(b);
+    return memcmp(a->chars, b->chars, a->length) == 0;
 }
 
 ObjUpvalue* newUpvalue(Value* slot) {
@@ -175,9 +453,24 @@ void printObject(Value value) {
         case OBJ_NATIVE:
             printf("<native fn>");
             break;
-        case OBJ_STRING:
-            printf("%s", AS_CSTRING(value));
+        case OBJ_SHAPE:
+            printf("shape");
+            break;
+        case OBJ_STRING: {
+            ObjString* string = AS_STRING(value);
+            if (string->chars != NULL) {
+                printf("%s", string->chars);
+                break;
+            }
+            // This runs where a collection can't, like in the GC's own
+            // logging, so a rope is copied out without flattening it.
+            char* chars = (char*)malloc(string->length);
+            if (chars == NULL) exit(1);
+            copyChars(string, chars);
+            fwrite(chars, 1, string->length, stdout);
+            free(chars);
             break;
+        }
         case OBJ_UPVALUE:
             printf("upvalue");
             break;
@@ -8,12 +8,6 @@
 #include "common.h"
 #include "scanner.h"
 
-typedef struct {
-    const char* start;
-    const char* current;
-    int line;
-} Scanner;
-
 Scanner scanner;
 
 static bool isAtEnd() {
@@ -191,6 +185,14 @@ void initScanner(const char* source) {
     scanner.line = 1;
 }
 
+Scanner saveScanner() {
+    return scanner;
+}
+
+void restoreScanner(Scanner state) {
+    scanner = state;
+}
+
 Token scanToken() {
     skipWhitespace();
     /*
@@ -4,106 +4,225 @@
 
 #include <stdlib.h>
 #include <string.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 
 #include "memory.h"
 #include "object.h"
 #include "table.h"
 #include "value.h"
 
-#define TABLE_MAX_LOAD 0.75
+/*
+ * A control byte is the low seven bits of a full slot's hash, or one of
+ * these, which have the top bit set. The rest of the hash picks the group
+ * a probe starts from.
+ */
+#define CONTROL_EMPTY 0x80
+#define CONTROL_DELETED 0xfe
+
+#define HASH_TAG(hash) ((uint8_t)((hash) & 0x7f))
+#define HASH_START(hash) ((hash) >> 7)
+
+// Seven eighths full, counting tombstones, is as full as a table gets.
+#define MAX_LOAD(capacity) ((capacity) - (capacity) / 8)
+
+static uint8_t* controlBytes(Entry* entries, int capacity) {
+    return (uint8_t*)(entries + capacity);
+}
+
+// Bit i is set if the group's byte i is `byte`.
+static uint32_t matchByte(const uint8_t* group, uint8_t byte) {
+#ifdef __SSE2__
+    __m128i bytes = _mm_loadu_si128((const __m128i*)group);
+    return (uint32_t)_mm_movemask_epi8(
+            _mm_cmpeq_epi8(bytes, _mm_set1_epi8((char)byte)));
+#else
+    uint32_t matches = 0;
+    for (int i = 0; i < TABLE_GROUP_WIDTH; i++) {
+        if (group[i] == byte) matches |= 1u << i;
+    }
+    return matches;
+#endif
+}
+
+// The slots in the group that are empty or tombstones.
+static uint32_t matchFree(const uint8_t* group) {
+#ifdef __SSE2__
+    return (uint32_t)_mm_movemask_epi8(
+            _mm_loadu_si128((const __m128i*)group));
+#else
+    uint32_t matches = 0;
+    for (int i = 0; i < TABLE_GROUP_WIDTH; i++) {
+        if (group[i] & 0x80) matches |= 1u << i;
+    }
+    return matches;
+#endif
+}
+
+static void setControl(uint8_t* control, int capacity, uint32_t index,
+                       uint8_t byte) {
+    control[index] = byte;
+    // A table smaller than a group repeats in the copy more than once.
+    for (uint32_t i = index; i < TABLE_GROUP_WIDTH; i += capacity) {
+        control[capacity + i] = byte;
+    }
+}
 
 void initTable(Table* table) {
     table->count = 0;
+    table->tombstones = 0;
     table->capacity = 0;
     table->entries = NULL;
 }
 
 void freeTable(Table* table) {
-    FREE_ARRAY(Entry, table->entries, table->capacity);
+    if (table->entries != NULL) {
+        reallocate(table->entries, tableBlockSize(table->capacity), 0);
+    }
     initTable(table);
 }
 
+/*
+ * Probes go a group at a time, each step one group further than the last.
+ * With a power-of-two capacity that comes to every group before repeating,
+ * and as no table is ever full a probe always ends at an empty slot.
+ */
 static Entry* findEntry(Entry* entries, int capacity,
                         ObjString* key) {
-    uint32_t index = key->hash % capacity;
-    Entry* tombstone = NULL;
-
-    for (;;) {
-        Entry* entry = &entries[index];
-        // we probe a sequence during a lookup, we hit the tombstone,
-        // we note this is a tombstone and we keeping
-        if (entry->key == NULL) {
-            if (IS_NIL(entry->value)) {
-                // empty entry
-                return tombstone != NULL ? tombstone : entry;
-            } else {
-                // we found the tombstone
-                if (tombstone == NULL) tombstone = entry;
-            }
-        } else if (entry->key == key) {
-            // we found the key
-            return entry;
-        }
-        if (entry->key == key || entry->key == NULL) {
-            return entry;
+    uint8_t* control = controlBytes(entries, capacity);
+    uint32_t mask = capacity - 1;
+    uint8_t tag = HASH_TAG(key->hash);
+    uint32_t index = HASH_START(key->hash) & mask;
+
+    for (uint32_t step = TABLE_GROUP_WIDTH;; step += TABLE_GROUP_WIDTH) {
+        const uint8_t* group = control + index;
+        uint32_t matches = matchByte(group, tag);
+        while (matches != 0) {
+            Entry* entry = &entries[(index + lowestBit(matches)) & mask];
+            if (entry->key == key) return entry;
+            matches &= matches - 1;
         }
+        // The key would have gone in this group if it had room.
+        if (matchByte(group, CONTROL_EMPTY) != 0) return NULL;
 
-        index = (index + 1) % capacity;
+        index = (index + step) & mask;
     }
 }
 
+// Puts a key that isn't in the table in the first free slot on its probe.
+static void insertEntry(Table* table, ObjString* key, Value value) {
+    uint8_t* control = controlBytes(table->entries, table->capacity);
+    uint32_t mask = table->capacity - 1;
+    uint32_t index = HASH_START(key->hash) & mask;
+
+    uint32_t step = TABLE_GROUP_WIDTH;
+    uint32_t matches;
+    while ((matches = matchFree(control + index)) == 0) {
+        index = (index + step) & mask;
+        step += TABLE_GROUP_WIDTH;
+    }
+    index = (index + lowestBit(matches)) & mask;
+
+    if (control[index] == CONTROL_DELETED) table->tombstones--;
+    setControl(control, table->capacity, index, HASH_TAG(key->hash));
+    table->entries[index].key = key;
+    table->entries[index].value = value;
+    table->count++;
+}
+
 bool tableGet(Table* table, ObjString* key, Value* value) {
     if (table->count == 0) return false;  // this table is empty
 
     Entry* entry = findEntry(table->entries, table->capacity, key);
-    if (entry->key == NULL) return false;
+    if (entry == NULL) return false;
 
     *value = entry->value;
     return true;
 }
 
+/*
+ * Rebuilds the table at `capacity`, which drops its tombstones. Allocating
+ * can run a collection that deletes from this very table, so the old
+ * entries are only read once the new block is in hand.
+ */
 static void adjustCapacity(Table* table, int capacity) {
-    Entry* entries = ALLOCATE(Entry, capacity);
+    Entry* entries = reallocate(NULL, 0, tableBlockSize(capacity));
     for (int i = 0; i < capacity; i++) {
         entries[i].key = NULL;
         entries[i].value = NIL_VAL;
     }
+    memset(controlBytes(entries, capacity), CONTROL_EMPTY,
+           capacity + TABLE_GROUP_WIDTH);
 
+    Entry* oldEntries = table->entries;
+    int oldCapacity = table->capacity;
+    table->entries = entries;
+    table->capacity = capacity;
     table->count = 0;
-    for (int i = 0; i < table->capacity; i++) {
-        Entry* entry = &table->entries[i];
-        if (entry->key == NULL) continue;
+    table->tombstones = 0;
 
-        Entry* dest = findEntry(entries, capacity, entry->key);
-        dest->key = entry->key;
-        dest->value = entry->value;
-        table->count++;
+    for (int i = 0; i < oldCapacity; i++) {
+        Entry* entry = &oldEntries[i];
+        if (entry->key == NULL) continue;
+        insertEntry(table, entry->key, entry->value);
     }
 
-    FREE_ARRAY(Entry, table->entries, table->capacity);
-    table->entries = entries;
-    table->capacity = capacity;
+    if (oldEntries != NULL) {
+        reallocate(oldEntries, tableBlockSize(oldCapacity), 0);
+    }
 }
 
 // We put the string object into hash tables
 bool tableSet(Table* table, ObjString* key, Value value) {
+    if (table->count != 0) {
+        Entry* entry = findEntry(table->entries, table->capacity, key);
+        if (entry != NULL) {
+            entry->value = value;
+            return false;
+        }
+    }
+
     /*
-     * before insert, check we have an array, and that's big enough
+     * before insert, check there's room, tombstones included. If it's
+     * mostly tombstones that filled the table, clearing them out makes
+     * enough room without growing it.
      */
-    if (table->count + 1 > table->capacity * TABLE_MAX_LOAD) {
-        int capacity = GROW_CAPACITY(table->capacity);
+    if (table->count + table->tombstones + 1 > MAX_LOAD(table->capacity)) {
+        int capacity = table->capacity;
+        if (table->count + 1 > MAX_LOAD(capacity) / 2) {
+            capacity = GROW_CAPACITY(capacity);
+        }
         adjustCapacity(table, capacity);
     }
 
-    Entry* entry = findEntry(table->entries, table->capacity, key);
-    bool isNewKey = entry->key == NULL;
-//    if (isNewKey) table->count++;
-    // this time we also count the tombstone into account
-    if (isNewKey && IS_NIL(entry->value)) table->count++;
+    insertEntry(table, key, value);
+    return true;
+}
+
+/*
+ * A deleted slot has to stay a tombstone if some probe may have stepped
+ * over it on the way to a key further on. One can't have if every group
+ * the slot is in still has an empty slot, as a probe stops at the first
+ * group with one. In a table smaller than a group, that group is the
+ * whole table, which always has an empty slot.
+ */
+static bool wasNeverFull(uint8_t* control, int capacity, uint32_t index) {
+    if (capacity < TABLE_GROUP_WIDTH) return true;
+
+    uint32_t mask = capacity - 1;
+    uint32_t before = matchByte(control + ((index - TABLE_GROUP_WIDTH) & mask),
+                                CONTROL_EMPTY);
+    uint32_t after = matchByte(control + index, CONTROL_EMPTY);
+    if (before == 0 || after == 0) return false;
 
-    entry->key = key;
-    entry->value = value;
-    return isNewKey;
+    // The run of non-empty slots around this one is shorter than a group.
+    int fullBefore = 0;
+    for (uint32_t bit = 1u << (TABLE_GROUP_WIDTH - 1); (before & bit) == 0;
+         bit >>= 1) {
+        fullBefore++;
+    }
+    return fullBefore + lowestBit(after) < TABLE_GROUP_WIDTH;
 }
 
 // we add a tombstone when we delete the k/v pair
@@ -112,11 +231,20 @@ bool tableDelete(Table* table, ObjString* key) {
 
     // find the entry
     Entry* entry = findEntry(table->entries, table->capacity, key);
-    if (entry->key == NULL) return false;
+    if (entry == NULL) return false;
 
-    // place a tombstone in the deleted entry
+    uint8_t* control = controlBytes(table->entries, table->capacity);
+    uint32_t index = (uint32_t)(entry - table->entries);
+    if (wasNeverFull(control, table->capacity, index)) {
+        setControl(control, table->capacity, index, CONTROL_EMPTY);
+    } else {
+        // place a tombstone in the deleted entry
+        setControl(control, table->capacity, index, CONTROL_DELETED);
+        table->tombstones++;
+    }
     entry->key = NULL;
-    entry->value = BOOL_VAL(true);  // this tombstone
+    entry->value = NIL_VAL;
+    table->count--;
     return true;
 }
 
@@ -143,43 +271,35 @@ void tableAddAll(Table* from, Table* to) {
  * If there is a hash collision, we do an actual character-by-character string
  * comparison. This is the one place in the VM where we actually test strings
  * for textual equality. We do it here to deduplicate strings and then the rest
- * of the VM can take for granted that any two strings at different addresses
- * in memory must have different contents.
+ * of the VM can take for granted that any two interned strings at different
+ * addresses in memory must have different contents.
  */
 ObjString* tableFindString(Table* table, const char* chars,
                            int length, uint32_t hash) {
     if (table->count == 0) return NULL;  // the table is empty
 
-    uint32_t index = hash % table->capacity;
-    for (;;) {
-        Entry* entry = &table->entries[index];
-        if (entry->key == NULL) {
-            // stop if we find an empty non-tombstone entry
-            if (IS_NIL(entry->value)) return NULL;
-        } else if (entry->key->length == length &&
-                   entry->key->hash == hash &&
-                   memcmp(entry->key->chars, chars, length) == 0) {
-            // we just found it
-            return entry->key;
-        }
-
-        index = (index + 1) % table->capacity;
-    }
-}
+    uint8_t* control = controlBytes(table->entries, table->capacity);
+    uint32_t mask = table->capacity - 1;
+    uint8_t tag = HASH_TAG(hash);
+    uint32_t index = HASH_START(hash) & mask;
 
-/*
- * We walk every entry in the table. The string intern table uses only the key
- * of each entry - it's basically a hash *set* not a hash *map*. If the key
- * string object's mark bit is not set, then it is a white object that is moments
- * from being swept away. We delete it from the hash table first and thus ensure
- * we won't see any dangling pointers.
- */
-void tableRemoveWhite(Table* table) {
-    for (int i = 0; i < table->capacity; i++) {
-        Entry* entry = &table->entries[i];
-        if (entry->key != NULL && !entry->key->obj.isMarked) {
-            tableDelete(table, entry->key);
+    for (uint32_t step = TABLE_GROUP_WIDTH;; step += TABLE_GROUP_WIDTH) {
+        const uint8_t* group = control + index;
+        uint32_t matches = matchByte(group, tag);
+        while (matches != 0) {
+            Entry* entry = &table->entries[(index + lowestBit(matches)) & mask];
+            if (entry->key->length == length &&
+                entry->key->hash == hash &&
+                memcmp(entry->key->chars, chars, length) == 0) {
+                // we just found it
+                return entry->key;
+            }
+            matches &= matches - 1;
         }
+        // stop if the group has an empty slot
+        if (matchByte(group, CONTROL_EMPTY) != 0) return NULL;
+
+        index = (index + step) & mask;
     }
 }
 
@@ -189,4 +309,4 @@ void markTable(Table* table) {
         markObject((Obj*)entry->key);
         markValue(entry->value);
     }
-}
\ No newline at end of file
+}
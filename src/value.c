@@ -34,6 +34,17 @@ void freeValueArray(ValueArray* array) {
 void printValue(Value value) {
 //    printf("%g", value);
 //    printf("%g", AS_NUMBER(value));
+#ifdef NAN_BOXING
+    if (IS_BOOL(value)) {
+        printf(AS_BOOL(value) ? "true" : "false");
+    } else if (IS_NIL(value)) {
+        printf("nil");
+    } else if (IS_NUMBER(value)) {
+        printf("%g", AS_NUMBER(value));
+    } else if (IS_OBJ(value)) {
+        printObject(value);
+    }
+#else
     switch (value.type) {
         case VAL_BOOL:
             printf(AS_BOOL(value) ? "true" : "false");
@@ -42,10 +53,25 @@ void printValue(Value value) {
             printf("nil"); break;
         case VAL_NUMBER: printf("%g", AS_NUMBER(value)); break;
         case VAL_OBJ: printObject(value); break;
+        case VAL_UNDEFINED: break;
     }
+#endif
 }
 
 bool valuesEqual(Value a, Value b) {
+#ifdef NAN_BOXING
+    /*
+     * Every non-number is canonical, so comparing the bits is enough. Numbers
+     * still go through the FPU so that NaN != NaN and 0 == -0, same as before.
+     * Strings are the exception, since a rope isn't interned.
+     */
+    if (IS_NUMBER(a) && IS_NUMBER(b)) {
+        return AS_NUMBER(a) == AS_NUMBER(b);
+    }
+    if (a == b) return true;
+    return IS_STRING(a) && IS_STRING(b) &&
+           stringsEqual(AS_STRING(a), AS_STRING(b));
+#else
     if (a.type != b.type) return false;
     switch (a.type) {
         case VAL_BOOL:    return AS_BOOL(a) == AS_BOOL(b);
@@ -65,7 +91,12 @@ bool valuesEqual(Value a, Value b) {
          * When that, we have a full-featured hash table ready for us to use for
          * tracking variables, instances, or any other k/v pairs that might show up.
          */
-        case VAL_OBJ:     return AS_OBJ(a) == AS_OBJ(b);
+        case VAL_OBJ:
+            if (IS_STRING(a) && IS_STRING(b)) {
+                return stringsEqual(AS_STRING(a), AS_STRING(b));
+            }
+            return AS_OBJ(a) == AS_OBJ(b);
         default:          return false;  // unreachable.
     }
+#endif
 }
\ No newline at end of file
@@ -6,6 +6,7 @@
 #include "common.h"
 #include "compiler.h"
 #include "debug.h"
+#include "marker.h"
 #include "memory.h"
 #include "object.h"
 #include <stdarg.h>
@@ -13,12 +14,87 @@
 #include <string.h>
 #include <time.h>
 
+/*
+ * Labels-as-values ("computed goto") is a GNU extension that GCC and Clang
+ * both support. Anywhere else we quietly fall back to the portable switch.
+ */
+#if defined(COMPUTED_GOTO) && (defined(__GNUC__) || defined(__clang__))
+#define THREADED_DISPATCH
+#endif
+
 VM vm;
 
 static Value clockNative(int argCount, Value* args) {
     return NUMBER_VAL((double)clock() / CLOCKS_PER_SEC);
 }
 
+static const char* pauseFields[GC_PAUSE_BUCKETS] = {
+        "pausesUnder10us", "pausesUnder100us", "pausesUnder1ms",
+        "pausesUnder10ms", "pausesUnder100ms", "pausesOver100ms",
+};
+
+// A new empty class called `name`.
+static ObjClass* statsClass(const char* name) {
+    push(OBJ_VAL(copyString(name, (int)strlen(name))));
+    ObjClass* klass = newClass(AS_STRING(vm.stackTop[-1]));
+    pop();
+    return klass;
+}
+
+static void pushInstance(ObjClass* klass) {
+    push(OBJ_VAL(newInstance(klass)));
+}
+
+// Pops a value and stores it in field `name` of the instance under it.
+static void popIntoField(const char* name) {
+    push(OBJ_VAL(copyString(name, (int)strlen(name))));
+    addField(AS_INSTANCE(vm.stackTop[-3]), AS_STRING(vm.stackTop[-1]),
+             vm.stackTop[-2]);
+    vm.stackTop -= 2;
+}
+
+static void setNumberField(const char* name, double number) {
+    push(NUMBER_VAL(number));
+    popIntoField(name);
+}
+
+/*
+ * gcStats() returns an instance with a field for each of the GC stats,
+ * times in seconds like clock(). Those by object type are on an instance
+ * of their own, as in `gcStats().strings.live`.
+ */
+static Value gcStatsNative(int argCount, Value* args) {
+    GCStats stats;
+    readGCStats(&stats);
+
+    pushInstance(vm.gcStatsClass);
+    setNumberField("youngCollections", (double)stats.youngCollections);
+    setNumberField("fullCollections", (double)stats.fullCollections);
+    setNumberField("compactions", (double)stats.compactions);
+    setNumberField("pauses", (double)stats.pauses);
+    setNumberField("pauseTotal", stats.pauseSeconds);
+    setNumberField("pauseMax", stats.maxPauseSeconds);
+    for (int i = 0; i < GC_PAUSE_BUCKETS; i++) {
+        setNumberField(pauseFields[i], (double)stats.pauseHistogram[i]);
+    }
+    setNumberField("bytesAllocated", (double)stats.bytesAllocated);
+    setNumberField("bytesFreed", (double)stats.bytesFreed);
+    setNumberField("heapBytes", (double)vm.bytesAllocated);
+
+    for (int type = 0; type < OBJ_TYPE_COUNT; type++) {
+        pushInstance(vm.gcTypeStatsClass);
+        setNumberField("allocated", (double)stats.objectsAllocated[type]);
+        setNumberField("freed", (double)stats.objectsFreed[type]);
+        setNumberField("live", (double)(stats.objectsAllocated[type] -
+                                        stats.objectsFreed[type]));
+        setNumberField("bytesAllocated",
+                       (double)stats.objectBytesAllocated[type]);
+        setNumberField("bytesFreed", (double)stats.objectBytesFreed[type]);
+        popIntoField(objectTypeName((ObjType)type));
+    }
+    return pop();
+}
+
 static void resetStack() {
     // free the stack, now empty
     vm.stackTop = vm.stack;
@@ -66,25 +142,74 @@ static void runtimeError(const char *format, ...) {
     resetStack();
 }
 
+/*
+ * Returns the slot for the global `name`, adding an undefined one the first
+ * time the name is seen. The compiler calls this for every global it
+ * resolves, so a function can refer to a global defined later in the script.
+ */
+int globalSlot(ObjString* name) {
+    Value slot;
+    if (tableGet(&vm.globalSlots, name, &slot)) return (int)AS_NUMBER(slot);
+
+    push(OBJ_VAL(name));
+    int index = vm.globalValues.count;
+    writeValueArray(&vm.globalValues, UNDEFINED_VAL);
+    writeValueArray(&vm.globalNames, OBJ_VAL(name));
+    tableSet(&vm.globalSlots, name, NUMBER_VAL(index));
+    pop();
+    return index;
+}
+
 // helper function for callValue()
 static void defineNative(const char* name, NativeFn function) {
     push(OBJ_VAL(copyString(name, (int)strlen(name))));
     push(OBJ_VAL(newNative(function)));
-    tableSet(&vm.globals, AS_STRING(vm.stack[0]), vm.stack[1]);
+    int slot = globalSlot(AS_STRING(vm.stack[0]));
+    vm.globalValues.values[slot] = vm.stack[1];
     pop();
     pop();
 }
 
 void initVM() {
+    initHeap(&vm.heap);
     resetStack();
-    vm.objects = NULL;
     /*
      * The starting threshold is arbitrary.
      * The goal is to not trigger the first few
      * GCs too quickly but also to not wait too long.
      */
     vm.bytesAllocated = 0;
-    vm.nextGC = 1024 * 1024;
+    GCPolicy policy;
+    initGCPolicy(&policy);
+    setGCPolicy(&policy);
+    initGCStats(&vm.gcStats);
+    vm.errorJump = NULL;
+    vm.nextYoungGC = NURSERY_SIZE;
+    vm.youngObjects = NULL;
+    vm.collectingYoung = false;
+    vm.rememberedCount = 0;
+    vm.rememberedCapacity = 0;
+    vm.remembered = NULL;
+    vm.gcPhase = GC_IDLE;
+    vm.gcSliceBudget = GC_SLICE_BUDGET;
+    vm.sweepPage = NULL;
+    vm.gcCompactOccupancy = GC_COMPACT_OCCUPANCY;
+    vm.compactRequested = false;
+#ifdef PARALLEL_MARK
+    vm.gcMarkThreads = defaultMarkThreads();
+#else
+    vm.gcMarkThreads = 1;
+#endif
+    vm.gcParallelMarkBytes = GC_PARALLEL_MARK_BYTES;
+    vm.markingInParallel = false;
+#ifdef CONCURRENT_SWEEP
+    vm.gcSweepInBackground = true;
+#else
+    vm.gcSweepInBackground = false;
+#endif
+    vm.sweeperRunning = false;
+    vm.heapLockDepth = 0;
+    vm.heapLockTaken = false;
 
     // init the gray parameters
     vm.grayCount = 0;
@@ -92,22 +217,37 @@ void initVM() {
     vm.grayStack = NULL;
 
     // we need to initialize the hash table to a valid state
-    initTable(&vm.globals);
+    initTable(&vm.globalSlots);
+    initValueArray(&vm.globalNames);
+    initValueArray(&vm.globalValues);
     // when we spin up a new VM, the string table is empty
     initTable(&vm.strings);
 
     vm.initString = NULL;
     vm.initString = copyString("init", 4);
+    vm.gcStatsClass = NULL;
+    vm.gcTypeStatsClass = NULL;
+    vm.gcStatsClass = statsClass("GCStats");
+    vm.gcTypeStatsClass = statsClass("GCTypeStats");
 
     defineNative("clock", clockNative);
+    defineNative("gcStats", gcStatsNative);
 }
 
 void freeVM() {
-    freeTable(&vm.globals);
+    // A sweeper thread still at it would be freeing from under us.
+    completeSweep();
+    freeTable(&vm.globalSlots);
+    freeValueArray(&vm.globalNames);
+    freeValueArray(&vm.globalValues);
     // when we shut down the VM, we clean up any resources used by the table.
     freeTable(&vm.strings);
     vm.initString = NULL;
+    vm.gcStatsClass = NULL;
+    vm.gcTypeStatsClass = NULL;
     freeObjects();
+    // Last, since everything above hands its memory back to the heap.
+    freeHeap(&vm.heap);
 }
 
 /*
@@ -137,7 +277,7 @@ static Value peek(int distance) {
 //static bool call(ObjFunction* function, int argCount) {
 static bool call(ObjClosure* closure, int argCount) {
     if (argCount != closure->function->arity) {  // we check the arity here
-        runtimeError("Expected %d arguments but got $d.",
+        runtimeError("Expected %d arguments but got %d.",
                      closure->function->arity, argCount);
         return false;
     }
@@ -149,12 +289,21 @@ static bool call(ObjClosure* closure, int argCount) {
         return false;
     }
 
+    // A function can have more locals than its share of the stack, so check
+    // there is room for them, plus some for temporaries.
+    Value* slots = vm.stackTop - argCount - 1;
+    if (slots + closure->function->slotCount + UINT8_COUNT >
+        vm.stack + STACK_MAX) {
+        runtimeError("Stack overflows.");
+        return false;
+    }
+
     CallFrame* frame = &vm.frames[vm.frameCount++];
 //    frame->function = function;
 //    frame->ip = function->chunk.code;
     frame->closure = closure;
     frame->ip = closure->function->chunk.code;
-    frame->slots = vm.stackTop - argCount - 1;
+    frame->slots = slots;
     return true;
 }
 
@@ -208,7 +357,48 @@ static bool invokeFromClass(ObjClass* klass, ObjString* name, int argCount) {
     return call(AS_CLOSURE(method), argCount);
 }
 
-static bool invoke(ObjString* name, int argCount) {
+static inline CacheWay* findCacheWay(InlineCache* cache, ObjShape* shape) {
+    for (int i = 0; i < INLINE_CACHE_WAYS; i++) {
+        if (cache->ways[i].shape == (Obj*)shape) return &cache->ways[i];
+    }
+    return NULL;
+}
+
+// Records what the name resolved to for `shape` at this site. A shape
+// already cached is updated in place; otherwise it becomes the first way and
+// the least recently added one falls off the end.
+static void updateCache(InlineCache* cache, ObjShape* shape,
+                        Obj* target, int index) {
+    CacheWay* way = findCacheWay(cache, shape);
+    if (way == NULL) {
+        memmove(&cache->ways[1], &cache->ways[0],
+                sizeof(CacheWay) * (INLINE_CACHE_WAYS - 1));
+        way = &cache->ways[0];
+        way->shape = (Obj*)shape;
+    }
+    way->target = target;
+    way->index = index;
+
+    // The cache belongs to the function running in the top frame.
+    Obj* owner = (Obj*)vm.frames[vm.frameCount - 1].closure->function;
+    writeBarrier(owner, OBJ_VAL(shape));
+    if (target != NULL) writeBarrier(owner, OBJ_VAL(target));
+}
+
+/*
+ * A shape fixes both the field layout and the class, so a way that matches
+ * the receiver's shape is exact: a field is at the cached slot, and a cached
+ * method can't be shadowed by a field because the shape has none by that
+ * name.
+ */
+static inline ObjClosure* cachedMethod(InlineCache* cache,
+                                       ObjInstance* instance) {
+    CacheWay* way = findCacheWay(cache, instance->shape);
+    if (way == NULL) return NULL;
+    return (ObjClosure*)way->target;
+}
+
+static bool invoke(ObjString* name, int argCount, InlineCache* cache) {
     Value receiver = peek(argCount);
 
     if (!IS_INSTANCE(receiver)) {
@@ -219,12 +409,18 @@ static bool invoke(ObjString* name, int argCount) {
     ObjInstance* instance = AS_INSTANCE(receiver);
 
     Value value;
-    if (tableGet(&instance->fields, name, &value)) {
+    if (getField(instance, name, &value)) {
         vm.stackTop[-argCount - 1] = value;
         return callValue(value, argCount);
     }
 
-    return invokeFromClass(instance->klass, name, argCount);
+    Value method;
+    if (!tableGet(&instance->klass->methods, name, &method)) {
+        runtimeError("Undefined property '%s'.", name->chars);
+        return false;
+    }
+    updateCache(cache, instance->shape, AS_OBJ(method), -1);
+    return call(AS_CLOSURE(method), argCount);
 }
 
 static bool bindMethod(ObjClass* klass, ObjString* name) {
@@ -241,6 +437,46 @@ static bool bindMethod(ObjClass* klass, ObjString* name) {
     return true;
 }
 
+// Uncached OP_GET_PROPERTY. The instance is on top of the stack.
+static bool getProperty(ObjString* name, InlineCache* cache) {
+    ObjInstance* instance = AS_INSTANCE(peek(0));
+
+    int slot = shapeSlot(instance->shape, name);
+    if (slot != -1) {
+        updateCache(cache, instance->shape, NULL, slot);
+        vm.stackTop[-1] = instance->fields[slot];
+        return true;
+    }
+
+    Value method;
+    if (!tableGet(&instance->klass->methods, name, &method)) {
+        runtimeError("Undefined property '%s'.", name->chars);
+        return false;
+    }
+    updateCache(cache, instance->shape, AS_OBJ(method), -1);
+
+    ObjBoundMethod* bound = newBoundMethod(peek(0), AS_CLOSURE(method));
+    vm.stackTop[-1] = OBJ_VAL(bound);
+    return true;
+}
+
+// Uncached OP_SET_PROPERTY. The instance is below the value on the stack.
+static void setProperty(ObjString* name, InlineCache* cache) {
+    ObjInstance* instance = AS_INSTANCE(peek(1));
+    ObjShape* shape = instance->shape;
+
+    int slot = shapeSlot(shape, name);
+    if (slot != -1) {
+        instance->fields[slot] = peek(0);
+        writeBarrier((Obj*)instance, peek(0));
+        updateCache(cache, shape, NULL, slot);
+        return;
+    }
+
+    slot = addField(instance, name, peek(0));
+    updateCache(cache, shape, (Obj*)instance->shape, slot);
+}
+
 // helper func in run() case OP_CLOSURE:
 static ObjUpvalue* captureUpvalue(Value* local) {
     ObjUpvalue* preUpvalue = NULL;
@@ -272,6 +508,7 @@ static void closeUpvalues(Value* last) {
         ObjUpvalue* upvalue = vm.openUpvalues;
         upvalue->closed = *upvalue->location;
         upvalue->location = &upvalue->closed;
+        writeBarrier((Obj*)upvalue, upvalue->closed);
         vm.openUpvalues = upvalue->next;
     }
 }
@@ -280,6 +517,8 @@ static void defineMethod(ObjString* name) {
     Value method = peek(0);
     ObjClass* klass = AS_CLASS(peek(1));
     tableSet(&klass->methods, name, method);
+    writeBarrier((Obj*)klass, method);
+    writeBarrier((Obj*)klass, OBJ_VAL(name));
     pop();
 }
 
@@ -293,34 +532,125 @@ static void concatenate() {
     ObjString* b = AS_STRING(peek(0));
     ObjString* a = AS_STRING(peek(1));
 
-    int length = a->length + b->length;
-    char *chars = ALLOCATE(char, length + 1);
-    memcpy(chars, a->chars, a->length);
-    memcpy(chars + a->length, b->chars, b->length);
-    chars[length] = '\0';
-
-    ObjString *result = takeString(chars, length);
+    ObjString *result = concatenateStrings(a, b);
     pop();
     pop();
     push(OBJ_VAL(result));
 }
 
+#ifdef DEBUG_TRACE_EXECUTION
+static void traceExecution(CallFrame* frame) {
+    printf("        ");
+    for (Value *slot = vm.stack; slot < vm.stackTop; slot++) {
+        printf("[ ");
+        printValue(*slot);
+        printf(" ]");
+    }
+    printf("\n");
+//        disassembleInstruction(vm.chunk,
+//                               (int) (vm.ip - vm.chunk->code));
+    disassembleInstruction(&frame->closure->function->chunk,
+                           (int)(frame->ip - frame->closure->function->chunk.code));
+}
+#endif
+
 static InterpretResult run() {
-    CallFrame *frame = &vm.frames[vm.frameCount - 1];
+    /*
+     * The hottest state of the interpreter lives in C locals so the compiler
+     * can keep it in registers: the instruction pointer, the top of the value
+     * stack, the current frame's slot window and its constant table. Going
+     * through `frame->ip` or the global `vm.stackTop` instead costs a load and
+     * a store on nearly every instruction.
+     *
+     * The catch is that the copies in `frame` and `vm` go stale. Anything that
+     * can observe them has to see fresh values, so we write the registers back
+     * with SAVE_FRAME() before:
+     *   - calls and returns (callValue() and friends push frames and use the
+     *     global stack top),
+     *   - anything that may allocate, since the GC walks vm.stack up to
+     *     vm.stackTop looking for roots,
+     *   - runtime errors, which read every frame's ip for the stack trace.
+     * LOAD_FRAME() reloads all of it from whatever frame is on top afterwards.
+     */
+    CallFrame *frame;
+    register uint8_t *ip;
+    register Value *stackTop;
+    Value *slots;
+    Value *constants;
+    // Operands a long instruction decodes before it joins the handler of
+    // its short form.
+    ObjString *name;
+    InlineCache *cache;
+    int argCount;
+    ObjFunction *function;
+
+#define SAVE_FRAME() \
+    (frame->ip = ip, vm.stackTop = stackTop)
 
-#define READ_BYTE() (*frame->ip++)
+#define LOAD_FRAME()                                                 \
+    (frame = &vm.frames[vm.frameCount - 1],                          \
+     ip = frame->ip,                                                 \
+     slots = frame->slots,                                           \
+     constants = frame->closure->function->chunk.constants.values,   \
+     stackTop = vm.stackTop)
+
+#ifdef COMPACTING_GC
+    /*
+     * Loop back edges, calls and returns are safe points: with the registers
+     * saved, nothing but the VM's own state points into the heap, so the
+     * objects can be moved. LOAD_FRAME() picks up where they went.
+     */
+#define SAFE_POINT()                \
+    do {                            \
+        if (vm.compactRequested) {  \
+            SAVE_FRAME();           \
+            compactHeap();          \
+            LOAD_FRAME();           \
+        }                           \
+    } while (false)
+#else
+#define SAFE_POINT() ((void)0)
+#endif
+
+    LOAD_FRAME();
+
+#define READ_BYTE() (*ip++)
 
 #define READ_SHORT() \
-    (frame->ip += 2, \
-     (uint16_t) ((frame->ip[-2] << 8) | frame->ip[-1]))
+    (ip += 2, \
+     (uint16_t) ((ip[-2] << 8) | ip[-1]))
+
+#define READ_LONG()                                               \
+    (ip += 3,                                                     \
+     (uint32_t) ((ip[-3] << 16) | (ip[-2] << 8) | ip[-1]))
 
-#define READ_CONSTANT() \
-    (frame->closure->function->chunk.constants.values[READ_BYTE()])
+#define READ_CONSTANT() (constants[READ_BYTE()])
+#define READ_CONSTANT_LONG() (constants[READ_LONG()])
 //#define READ_BYTE() (*vm.ip++)
 //#define READ_CONSTANT() (vm.chunk->constants.values[READ_BYTE()])
 //#define READ_SHORT() \
     (vm.ip += 2, (uint16_t)((vm.ip[-2] << 8) | vm.ip[-1]))
 #define READ_STRING() AS_STRING(READ_CONSTANT())
+#define READ_STRING_LONG() AS_STRING(READ_CONSTANT_LONG())
+#define READ_CACHE() \
+    (&frame->closure->function->chunk.caches[READ_SHORT()])
+#define READ_CACHE_LONG() \
+    (&frame->closure->function->chunk.caches[READ_LONG()])
+#define GLOBAL_NAME(slot) (AS_CSTRING(vm.globalNames.values[slot]))
+
+// The register-cached twins of push(), pop() and peek().
+#define PUSH(value) (*stackTop++ = (value))
+#define POP() (*--stackTop)
+#define DROP() (stackTop--)
+#define PEEK(distance) (stackTop[-1 - (distance)])
+
+#define RUNTIME_ERROR(...)                \
+    do {                                  \
+        SAVE_FRAME();                     \
+        runtimeError(__VA_ARGS__);        \
+        return INTERPRET_RUNTIME_ERROR;   \
+    } while (false)
+
     /*
      * Did you even know you can pass an *operator* as an argument to a macro?
      * The preprocessor doesn't care that operators aren't first class in C.
@@ -340,318 +670,702 @@ static InterpretResult run() {
  */
 #define BINARY_OP(valueType, op)                          \
     do {                                                  \
-        if (!IS_NUMBER(peek(0)) || !IS_NUMBER(peek(1))) { \
-            runtimeError("Operands must be numbers.");    \
-            return INTERPRET_RUNTIME_ERROR;               \
+        if (!IS_NUMBER(PEEK(0)) || !IS_NUMBER(PEEK(1))) { \
+            RUNTIME_ERROR("Operands must be numbers.");   \
         }                                                 \
-        double b = AS_NUMBER(pop());                      \
-        double a = AS_NUMBER(pop());                      \
-        push(valueType(a op b));                          \
+        double b = AS_NUMBER(POP());                      \
+        double a = AS_NUMBER(POP());                      \
+        PUSH(valueType(a op b));                          \
+    } while (false)
+
+#define REGISTER_OP(op, second)                                  \
+    do {                                                         \
+        Value *dest = &slots[READ_BYTE()];                       \
+        Value a = slots[READ_BYTE()];                            \
+        Value b = (second);                                      \
+        if (!IS_NUMBER(a) || !IS_NUMBER(b)) {                    \
+            RUNTIME_ERROR("Operands must be numbers.");          \
+        }                                                        \
+        *dest = NUMBER_VAL(AS_NUMBER(a) op AS_NUMBER(b));        \
+    } while (false)
+
+// Strings are concatenated on the stack, then stored to the destination.
+#define REGISTER_ADD(second)                                     \
+    do {                                                         \
+        Value *dest = &slots[READ_BYTE()];                       \
+        Value a = slots[READ_BYTE()];                            \
+        Value b = (second);                                      \
+        if (IS_NUMBER(a) && IS_NUMBER(b)) {                      \
+            *dest = NUMBER_VAL(AS_NUMBER(a) + AS_NUMBER(b));     \
+        } else if (IS_STRING(a) && IS_STRING(b)) {               \
+            PUSH(a);                                             \
+            PUSH(b);                                             \
+            SAVE_FRAME();                                        \
+            concatenate();                                       \
+            stackTop = vm.stackTop;                              \
+            *dest = POP();                                       \
+        } else {                                                 \
+            RUNTIME_ERROR(                                       \
+                    "Operands must be two numbers or two strings."); \
+        }                                                        \
+    } while (false)
+
+// JUMP_IF_FALSE leaves the condition on the stack for the POP that follows,
+// so the fused form pushes it too.
+#define COMPARE_LOCAL_CONSTANT_JUMP(op)                          \
+    do {                                                         \
+        Value a = slots[ip[0]];                                  \
+        if (IS_NUMBER(a)) {                                      \
+            bool result = AS_NUMBER(a) op                        \
+                          AS_NUMBER(constants[ip[2]]);           \
+            uint16_t offset = (uint16_t) ((ip[5] << 8) | ip[6]); \
+            PUSH(BOOL_VAL(result));                              \
+            ip += 7;                                             \
+            if (!result) ip += offset;                           \
+        } else {                                                 \
+            PUSH(a);                                             \
+            ip += 1;                                             \
+        }                                                        \
     } while (false)
 
-    for (;;) {
 #ifdef DEBUG_TRACE_EXECUTION
-        printf("        ");
-        for (Value *slot = vm.stack; slot < vm.stackTop; slot++) {
-            printf("[ ");
-            printValue(*slot);
-            printf(" ]");
-        }
-        printf("\n");
-//        disassembleInstruction(vm.chunk,
-//                               (int) (vm.ip - vm.chunk->code));
-        disassembleInstruction(&frame->closure->function->chunk,
-                               (int)(frame->ip - frame->closure->function->chunk.code));
+#define TRACE_INSTRUCTION() (SAVE_FRAME(), traceExecution(frame))
+#else
+#define TRACE_INSTRUCTION() ((void)0)
 #endif
-        uint8_t instruction;
-        switch (instruction = READ_BYTE()) {
-            case OP_CONSTANT: {
-                Value constant = READ_CONSTANT();
-                //                    printValue(constant);
-                //                    printf("\n");
-                push(constant);
-                break;
-            }
-            case OP_NIL:
-                push(NIL_VAL);
-                break;
-            case OP_TRUE:
-                push(BOOL_VAL(true));
-                break;
-            case OP_FALSE:
-                push(BOOL_VAL(false));
-                break;
-            case OP_POP:
-                pop();
-                break;
-            case OP_GET_LOCAL: {
-                uint8_t slot = READ_BYTE();
+
+    /*
+     * With a plain switch every instruction funnels through the same indirect
+     * jump at the top of the loop, so the CPU's branch predictor has a single
+     * slot to guess "what comes after whatever we just ran". Threaded dispatch
+     * ends every handler with its own `goto *dispatchTable[...]`, which gives
+     * the predictor one history per opcode (OP_LESS is nearly always followed
+     * by OP_JUMP_IF_FALSE, and so on).
+     *
+     * CASE() and DISPATCH() hide the difference, so the handlers below read the
+     * same either way. A handler must end with DISPATCH() rather than `break`.
+     */
+#ifdef THREADED_DISPATCH
+    static void* dispatchTable[] = {
+#define DISPATCH_ENTRY(opcode) [opcode] = &&label_##opcode
+        DISPATCH_ENTRY(OP_CONSTANT),
+        DISPATCH_ENTRY(OP_NIL),
+        DISPATCH_ENTRY(OP_TRUE),
+        DISPATCH_ENTRY(OP_FALSE),
+        DISPATCH_ENTRY(OP_POP),
+        DISPATCH_ENTRY(OP_GET_LOCAL),
+        DISPATCH_ENTRY(OP_SET_LOCAL),
+        DISPATCH_ENTRY(OP_GET_GLOBAL),
+        DISPATCH_ENTRY(OP_DEFINE_GLOBAL),
+        DISPATCH_ENTRY(OP_SET_GLOBAL),
+        DISPATCH_ENTRY(OP_GET_UPVALUE),
+        DISPATCH_ENTRY(OP_SET_UPVALUE),
+        DISPATCH_ENTRY(OP_GET_PROPERTY),
+        DISPATCH_ENTRY(OP_SET_PROPERTY),
+        DISPATCH_ENTRY(OP_GET_SUPER),
+        DISPATCH_ENTRY(OP_EQUAL),
+        DISPATCH_ENTRY(OP_GREATER),
+        DISPATCH_ENTRY(OP_LESS),
+        DISPATCH_ENTRY(OP_ADD),
+        DISPATCH_ENTRY(OP_SUBTRACT),
+        DISPATCH_ENTRY(OP_MULTIPLY),
+        DISPATCH_ENTRY(OP_DIVIDE),
+        DISPATCH_ENTRY(OP_NOT),
+        DISPATCH_ENTRY(OP_NEGATE),
+        DISPATCH_ENTRY(OP_PRINT),
+        DISPATCH_ENTRY(OP_JUMP),
+        DISPATCH_ENTRY(OP_JUMP_IF_FALSE),
+        DISPATCH_ENTRY(OP_LOOP),
+        DISPATCH_ENTRY(OP_CALL),
+        DISPATCH_ENTRY(OP_INVOKE),
+        DISPATCH_ENTRY(OP_SUPER_INVOKE),
+        DISPATCH_ENTRY(OP_CLOSURE),
+        DISPATCH_ENTRY(OP_CLOSE_UPVALUE),
+        DISPATCH_ENTRY(OP_RETURN),
+        DISPATCH_ENTRY(OP_CLASS),
+        DISPATCH_ENTRY(OP_INHERIT),
+        DISPATCH_ENTRY(OP_METHOD),
+        DISPATCH_ENTRY(OP_ADD_LOCALS),
+        DISPATCH_ENTRY(OP_ADD_LOCAL_CONSTANT),
+        DISPATCH_ENTRY(OP_LESS_LOCAL_CONSTANT_JUMP),
+        DISPATCH_ENTRY(OP_GREATER_LOCAL_CONSTANT_JUMP),
+        DISPATCH_ENTRY(OP_GET_LOCAL_PROPERTY),
+        DISPATCH_ENTRY(OP_SET_LOCAL_POP),
+        DISPATCH_ENTRY(OP_ADD_RR),
+        DISPATCH_ENTRY(OP_SUBTRACT_RR),
+        DISPATCH_ENTRY(OP_MULTIPLY_RR),
+        DISPATCH_ENTRY(OP_DIVIDE_RR),
+        DISPATCH_ENTRY(OP_ADD_RK),
+        DISPATCH_ENTRY(OP_SUBTRACT_RK),
+        DISPATCH_ENTRY(OP_MULTIPLY_RK),
+        DISPATCH_ENTRY(OP_DIVIDE_RK),
+        DISPATCH_ENTRY(OP_CONSTANT_LONG),
+        DISPATCH_ENTRY(OP_GET_LOCAL_LONG),
+        DISPATCH_ENTRY(OP_SET_LOCAL_LONG),
+        DISPATCH_ENTRY(OP_GET_GLOBAL_LONG),
+        DISPATCH_ENTRY(OP_DEFINE_GLOBAL_LONG),
+        DISPATCH_ENTRY(OP_SET_GLOBAL_LONG),
+        DISPATCH_ENTRY(OP_GET_UPVALUE_LONG),
+        DISPATCH_ENTRY(OP_SET_UPVALUE_LONG),
+        DISPATCH_ENTRY(OP_GET_PROPERTY_LONG),
+        DISPATCH_ENTRY(OP_SET_PROPERTY_LONG),
+        DISPATCH_ENTRY(OP_GET_SUPER_LONG),
+        DISPATCH_ENTRY(OP_JUMP_LONG),
+        DISPATCH_ENTRY(OP_JUMP_IF_FALSE_LONG),
+        DISPATCH_ENTRY(OP_LOOP_LONG),
+        DISPATCH_ENTRY(OP_INVOKE_LONG),
+        DISPATCH_ENTRY(OP_SUPER_INVOKE_LONG),
+        DISPATCH_ENTRY(OP_CLOSURE_LONG),
+        DISPATCH_ENTRY(OP_CLASS_LONG),
+        DISPATCH_ENTRY(OP_METHOD_LONG),
+#undef DISPATCH_ENTRY
+    };
+
+#define CASE(opcode) label_##opcode
+#define DISPATCH()                                \
+    do {                                          \
+        TRACE_INSTRUCTION();                      \
+        goto *dispatchTable[READ_BYTE()];         \
+    } while (false)
+#define INTERPRET_LOOP DISPATCH();
+#else
+#define CASE(opcode) case opcode
+#define DISPATCH() continue
+#define INTERPRET_LOOP \
+    for (;;) switch ((TRACE_INSTRUCTION(), READ_BYTE()))
+#endif
+
+    INTERPRET_LOOP {
+        CASE(OP_CONSTANT): {
+            Value constant = READ_CONSTANT();
+            //                    printValue(constant);
+            //                    printf("\n");
+            PUSH(constant);
+            DISPATCH();
+        }
+        CASE(OP_NIL):
+            PUSH(NIL_VAL);
+            DISPATCH();
+        CASE(OP_TRUE):
+            PUSH(BOOL_VAL(true));
+            DISPATCH();
+        CASE(OP_FALSE):
+            PUSH(BOOL_VAL(false));
+            DISPATCH();
+        CASE(OP_POP):
+            DROP();
+            DISPATCH();
+        CASE(OP_GET_LOCAL): {
+            uint8_t slot = READ_BYTE();
 //                push(vm.stack[slot]);
-                push(frame->slots[slot]);
-                break;
-            }
-            case OP_SET_LOCAL: {
-                uint8_t slot = READ_BYTE();
+            PUSH(slots[slot]);
+            DISPATCH();
+        }
+        CASE(OP_SET_LOCAL): {
+            uint8_t slot = READ_BYTE();
 //                vm.stack[slot] = peek(0);
-                frame->slots[slot] = peek(0);
-                break;
+            slots[slot] = PEEK(0);
+            DISPATCH();
+        }
+        CASE(OP_GET_GLOBAL): {
+            uint16_t slot = READ_SHORT();
+            Value value = vm.globalValues.values[slot];
+            if (IS_UNDEFINED(value)) {
+                RUNTIME_ERROR("Undefined variable '%s'.", GLOBAL_NAME(slot));
             }
-            case OP_GET_GLOBAL: {
-                ObjString *name = READ_STRING();
-                Value value;
-                if (!tableGet(&vm.globals, name, &value)) {
-                    runtimeError("Undefined variable '%s'.", name->chars);
-                    return INTERPRET_RUNTIME_ERROR;
-                }
-                push(value);
-                break;
+            PUSH(value);
+            DISPATCH();
+        }
+        CASE(OP_DEFINE_GLOBAL): {
+            uint16_t slot = READ_SHORT();
+            vm.globalValues.values[slot] = POP();
+            DISPATCH();
+        }
+        CASE(OP_SET_GLOBAL): {
+            uint16_t slot = READ_SHORT();
+            if (IS_UNDEFINED(vm.globalValues.values[slot])) {
+                RUNTIME_ERROR("Undefined variable '%s'.", GLOBAL_NAME(slot));
             }
-            case OP_DEFINE_GLOBAL: {
-                ObjString *name = READ_STRING();
-                tableSet(&vm.globals, name, peek(0));
-                pop();
-                break;
+            vm.globalValues.values[slot] = PEEK(0);
+            DISPATCH();
+        }
+        CASE(OP_GET_UPVALUE): {
+            uint8_t slot = READ_BYTE();
+            PUSH(*frame->closure->upvalues[slot]->location);
+            DISPATCH();
+        }
+        CASE(OP_SET_UPVALUE): {
+            ObjUpvalue *upvalue = frame->closure->upvalues[READ_BYTE()];
+            *upvalue->location = PEEK(0);
+            writeBarrier((Obj *) upvalue, PEEK(0));
+            DISPATCH();
+        }
+        CASE(OP_GET_PROPERTY_LONG):
+            name = READ_STRING_LONG();
+            cache = READ_CACHE_LONG();
+            goto getPropertyOp;
+        CASE(OP_GET_PROPERTY):
+            name = READ_STRING();
+            cache = READ_CACHE();
+        getPropertyOp: {
+            if (!IS_INSTANCE(PEEK(0))) {
+                RUNTIME_ERROR("Only instances have properties.");
             }
-            case OP_SET_GLOBAL: {
-                ObjString *name = READ_STRING();
-                if (tableSet(&vm.globals, name, peek(0))) {
-                    tableDelete(&vm.globals, name);
-                    runtimeError("Undefined variable '%s'.", name->chars);
-                    return INTERPRET_RUNTIME_ERROR;
-                }
-                break;
+
+            ObjInstance *instance = AS_INSTANCE(PEEK(0));
+
+            CacheWay *way = findCacheWay(cache, instance->shape);
+            if (way != NULL && way->target == NULL) {
+                PEEK(0) = instance->fields[way->index];
+                DISPATCH();
             }
-            case OP_GET_UPVALUE: {
-                uint8_t slot = READ_BYTE();
-                push(*frame->closure->upvalues[slot]->location);
-                break;
+
+            SAVE_FRAME();
+            if (way != NULL) {
+                ObjBoundMethod *bound = newBoundMethod(
+                        PEEK(0), (ObjClosure *) way->target);
+                PEEK(0) = OBJ_VAL(bound);
+            } else if (!getProperty(name, cache)) {
+                return INTERPRET_RUNTIME_ERROR;
             }
-            case OP_SET_UPVALUE: {
-                uint8_t slot = READ_BYTE();
-                *frame->closure->upvalues[slot]->location = peek(0);
-                break;
+            DISPATCH();
+        }
+        CASE(OP_SET_PROPERTY_LONG):
+            name = READ_STRING_LONG();
+            cache = READ_CACHE_LONG();
+            goto setPropertyOp;
+        CASE(OP_SET_PROPERTY):
+            name = READ_STRING();
+            cache = READ_CACHE();
+        setPropertyOp: {
+            if (!IS_INSTANCE(PEEK(1))) {
+                RUNTIME_ERROR("Only instances have fields.");
             }
-            case OP_GET_PROPERTY: {
-                if (!IS_INSTANCE(peek(0))) {
-                    runtimeError("Only instances have properties.");
-                    return INTERPRET_RUNTIME_ERROR;
-                }
 
-                ObjInstance *instance = AS_INSTANCE(peek(0));
-                ObjString *name = READ_STRING();
+            ObjInstance *instance = AS_INSTANCE(PEEK(1));
 
-                Value value;
-                if (tableGet(&instance->fields, name, &value)) {
-                    pop();// Instance
-                    push(value);
-                    break;
+            CacheWay *way = findCacheWay(cache, instance->shape);
+            if (way != NULL && way->index < instance->capacity) {
+                // Either an existing field, or the cached transition for
+                // adding it when the instance already has room.
+                instance->fields[way->index] = PEEK(0);
+                writeBarrier((Obj *) instance, PEEK(0));
+                if (way->target != NULL) {
+                    instance->shape = (ObjShape *) way->target;
+                    writeBarrier((Obj *) instance, OBJ_VAL(way->target));
                 }
-
-//                runtimeError("Undefined property '%s'.", name->chars);
-//                return INTERPRET_RUNTIME_ERROR;
-                if (!bindMethod(instance->klass, name)) {
-                    return INTERPRET_RUNTIME_ERROR;
-                }
-                break;
+            } else {
+                SAVE_FRAME();
+                setProperty(name, cache);
             }
-            case OP_SET_PROPERTY: {
-                if (!IS_INSTANCE(peek(1))) {
-                    runtimeError("Only instances have fields.");
-                    return INTERPRET_RUNTIME_ERROR;
-                }
+            Value value = POP();
+            PEEK(0) = value;
+            DISPATCH();
+        }
+        CASE(OP_GET_SUPER_LONG):
+            name = READ_STRING_LONG();
+            goto getSuperOp;
+        CASE(OP_GET_SUPER):
+            name = READ_STRING();
+        getSuperOp: {
+            ObjClass *superclass = AS_CLASS(POP());
 
-                ObjInstance *instance = AS_INSTANCE(peek(1));
-                tableSet(&instance->fields, READ_STRING(), peek(0));
-                Value value = pop();
-                pop();
-                push(value);
-                break;
+            SAVE_FRAME();
+            if (!bindMethod(superclass, name)) {
+                return INTERPRET_RUNTIME_ERROR;
             }
-            case OP_GET_SUPER: {
-                ObjString *name = READ_STRING();
-                ObjClass *superclass = AS_CLASS(pop());
-
-                if (!bindMethod(superclass, name)) {
-                    return INTERPRET_RUNTIME_ERROR;
-                }
-                break;
-            }
-            case OP_EQUAL: {
-                Value b = pop();
-                Value a = pop();
-                push(BOOL_VAL(valuesEqual(a, b)));
-                break;
+            stackTop = vm.stackTop;
+            DISPATCH();
+        }
+        CASE(OP_EQUAL): {
+            // Comparing ropes flattens them, which can collect.
+            SAVE_FRAME();
+            bool equal = valuesEqual(PEEK(1), PEEK(0));
+            DROP();
+            DROP();
+            PUSH(BOOL_VAL(equal));
+            DISPATCH();
+        }
+        CASE(OP_GREATER):
+            BINARY_OP(BOOL_VAL, >);
+            DISPATCH();
+        CASE(OP_LESS):
+            BINARY_OP(BOOL_VAL, <);
+            DISPATCH();
+            //            case OP_ADD:
+            //                BINARY_OP(+);
+            //                BINARY_OP(NUMBER_VAL, +);
+            //                break;
+        CASE(OP_ADD): {
+            if (IS_STRING(PEEK(0)) && IS_STRING(PEEK(1))) {
+                SAVE_FRAME();
+                concatenate();
+                stackTop = vm.stackTop;
+            } else if (IS_NUMBER(PEEK(0)) && IS_NUMBER(PEEK(1))) {
+                double b = AS_NUMBER(POP());
+                double a = AS_NUMBER(POP());
+                PUSH(NUMBER_VAL(a + b));
+            } else {
+                RUNTIME_ERROR(
+                        "Operands must be two numbers or two strings.");
             }
-            case OP_GREATER:
-                BINARY_OP(BOOL_VAL, >);
-                break;
-            case OP_LESS:
-                BINARY_OP(BOOL_VAL, <);
-                break;
-                //            case OP_ADD:
-                //                BINARY_OP(+);
-                //                BINARY_OP(NUMBER_VAL, +);
-                //                break;
-            case OP_ADD: {
-                if (IS_STRING(peek(0)) && IS_STRING(peek(1))) {
-                    concatenate();
-                } else if (IS_NUMBER(peek(0)) && IS_NUMBER(peek(1))) {
-                    double b = AS_NUMBER(pop());
-                    double a = AS_NUMBER(pop());
-                    push(NUMBER_VAL(a + b));
-                } else {
-                    runtimeError(
-                            "Operands must be two numbers or two strings.");
-                    return INTERPRET_RUNTIME_ERROR;
-                }
-                break;
+            DISPATCH();
+        }
+        CASE(OP_SUBTRACT):
+            //                BINARY_OP(-);
+            BINARY_OP(NUMBER_VAL, -);
+            DISPATCH();
+        CASE(OP_MULTIPLY):
+            //                BINARY_OP(*);
+            BINARY_OP(NUMBER_VAL, *);
+            DISPATCH();
+        CASE(OP_DIVIDE):
+            //                BINARY_OP(/);
+            BINARY_OP(NUMBER_VAL, /);
+            DISPATCH();
+            //                case OP_NEGATE:   push(-pop()); break;
+        CASE(OP_NOT):
+            stackTop[-1] = BOOL_VAL(isFalsey(stackTop[-1]));
+            DISPATCH();
+        CASE(OP_NEGATE):
+            if (!IS_NUMBER(PEEK(0))) {
+                RUNTIME_ERROR("Operand must be a number.");
             }
-            case OP_SUBTRACT:
-                //                BINARY_OP(-);
-                BINARY_OP(NUMBER_VAL, -);
-                break;
-            case OP_MULTIPLY:
-                //                BINARY_OP(*);
-                BINARY_OP(NUMBER_VAL, *);
-                break;
-            case OP_DIVIDE:
-                //                BINARY_OP(/);
-                BINARY_OP(NUMBER_VAL, /);
-                break;
-                //                case OP_NEGATE:   push(-pop()); break;
-            case OP_NOT:
-                push(BOOL_VAL(isFalsey(pop())));
-                break;
-            case OP_NEGATE:
-                if (!IS_NUMBER(peek(0))) {
-                    runtimeError("Operand must be a number.");
-                    return INTERPRET_RUNTIME_ERROR;
-                }
-                push(NUMBER_VAL(-AS_NUMBER(pop())));
-                break;
-            case OP_PRINT:
-                /*
-                 * When the interpreter reaches this instruction, it has already executed
-                 * the code for the expression, leaving the result value on top of the
-                 * stack. Now we simply pop and print it.
-                 */
-                printValue(pop());
-                printf("\n");
-                break;
-            case OP_JUMP: {
-                uint16_t offset = READ_SHORT();
+            stackTop[-1] = NUMBER_VAL(-AS_NUMBER(stackTop[-1]));
+            DISPATCH();
+        CASE(OP_PRINT):
+            /*
+             * When the interpreter reaches this instruction, it has already executed
+             * the code for the expression, leaving the result value on top of the
+             * stack. Now we simply pop and print it.
+             */
+            printValue(POP());
+            printf("\n");
+            DISPATCH();
+        CASE(OP_JUMP): {
+            uint16_t offset = READ_SHORT();
 //                vm.ip += offset;
-                frame->ip += offset;
-                break;
-            }
-            case OP_JUMP_IF_FALSE: {
-                uint16_t offset = READ_SHORT();
+            ip += offset;
+            DISPATCH();
+        }
+        CASE(OP_JUMP_IF_FALSE): {
+            uint16_t offset = READ_SHORT();
 //                if (isFalsey(peek(0))) vm.ip += offset;
-                if (isFalsey(peek(0))) frame->ip += offset;
-                break;
-            }
-            case OP_LOOP: {
-                uint16_t offset = READ_SHORT();
+            if (isFalsey(PEEK(0))) ip += offset;
+            DISPATCH();
+        }
+        CASE(OP_LOOP): {
+            uint16_t offset = READ_SHORT();
 //                vm.ip -= offset;
-                frame->ip -= offset;
-                break;
-            }
-            case OP_CALL: {
-                int argCount = READ_BYTE();
-                if (!callValue(peek(argCount), argCount)) {
-                    return INTERPRET_RUNTIME_ERROR;
-                }
-                /*
-                 * If callValue() is successful, there will be a new frame on the
-                 * CallFrame stack for the called function. The run() func has its
-                 * own cached pointer to the current frame. we need to update it.
-                 */
-                frame = &vm.frames[vm.frameCount - 1];
-                break;
+            ip -= offset;
+            SAFE_POINT();
+            DISPATCH();
+        }
+        CASE(OP_CALL): {
+            argCount = READ_BYTE();
+            SAVE_FRAME();
+            if (!callValue(PEEK(argCount), argCount)) {
+                return INTERPRET_RUNTIME_ERROR;
             }
-            case OP_INVOKE: {
-                ObjString *method = READ_STRING();
-                int argCount = READ_BYTE();
-                if (!invoke(method, argCount)) {
+            /*
+             * If callValue() is successful, there will be a new frame on the
+             * CallFrame stack for the called function. The run() func has its
+             * own cached pointer to the current frame. we need to update it.
+             */
+            LOAD_FRAME();
+            SAFE_POINT();
+            DISPATCH();
+        }
+        CASE(OP_INVOKE_LONG):
+            name = READ_STRING_LONG();
+            argCount = READ_BYTE();
+            cache = READ_CACHE_LONG();
+            goto invokeOp;
+        CASE(OP_INVOKE):
+            name = READ_STRING();
+            argCount = READ_BYTE();
+            cache = READ_CACHE();
+        invokeOp: {
+            SAVE_FRAME();
+
+            Value receiver = PEEK(argCount);
+            ObjClosure *method = IS_INSTANCE(receiver)
+                    ? cachedMethod(cache, AS_INSTANCE(receiver))
+                    : NULL;
+            if (method != NULL) {
+                if (!call(method, argCount)) {
                     return INTERPRET_RUNTIME_ERROR;
                 }
-                frame = &vm.frames[vm.frameCount - 1];
-                break;
+            } else if (!invoke(name, argCount, cache)) {
+                return INTERPRET_RUNTIME_ERROR;
             }
-            case OP_SUPER_INVOKE: {
-                ObjString *method = READ_STRING();
-                int argCount = READ_BYTE();
-                ObjClass *superclass = AS_CLASS(pop());
-                if (!invokeFromClass(superclass, method, argCount)) {
-                    return INTERPRET_RUNTIME_ERROR;
-                }
-                frame = &vm.frames[vm.frameCount - 1];
-                break;
+            LOAD_FRAME();
+            DISPATCH();
+        }
+        CASE(OP_SUPER_INVOKE_LONG):
+            name = READ_STRING_LONG();
+            goto superInvokeOp;
+        CASE(OP_SUPER_INVOKE):
+            name = READ_STRING();
+        superInvokeOp: {
+            argCount = READ_BYTE();
+            ObjClass *superclass = AS_CLASS(POP());
+            SAVE_FRAME();
+            if (!invokeFromClass(superclass, name, argCount)) {
+                return INTERPRET_RUNTIME_ERROR;
             }
-            case OP_CLOSURE: {
-                ObjFunction *function = AS_FUNCTION(READ_CONSTANT());
-                ObjClosure *closure = newClosure(function);
-                push(OBJ_VAL(closure));
-                for (int i = 0; i < closure->upvalueCount; i++) {
-                    uint8_t isLocal = READ_BYTE();
-                    uint8_t index = READ_BYTE();
-                    if (isLocal) {
-                        closure->upvalues[i] =
-                                captureUpvalue(frame->slots + index);
-                    } else {
-                        closure->upvalues[i] = frame->closure->upvalues[index];
-                    }
+            LOAD_FRAME();
+            DISPATCH();
+        }
+        CASE(OP_CLOSURE_LONG):
+            function = AS_FUNCTION(READ_CONSTANT_LONG());
+            goto closureOp;
+        CASE(OP_CLOSURE):
+            function = AS_FUNCTION(READ_CONSTANT());
+        closureOp: {
+            SAVE_FRAME();
+            ObjClosure *closure = newClosure(function);
+            PUSH(OBJ_VAL(closure));
+            // captureUpvalue() may allocate, so keep the closure visible.
+            vm.stackTop = stackTop;
+            for (int i = 0; i < closure->upvalueCount; i++) {
+                uint8_t isLocal = READ_BYTE();
+                uint16_t index = READ_SHORT();
+                if (isLocal) {
+                    closure->upvalues[i] =
+                            captureUpvalue(slots + index);
+                } else {
+                    closure->upvalues[i] = frame->closure->upvalues[index];
                 }
-                break;
+                // Capturing can collect and promote the closure.
+                writeBarrier((Obj *) closure, OBJ_VAL(closure->upvalues[i]));
             }
-            case OP_CLOSE_UPVALUE:
-                closeUpvalues(vm.stackTop - 1);
-                pop();
-                break;
-            case OP_RETURN: {
-                //                printValue(pop());
-                //                printf("\n");
-                // Exit interpreter
+            DISPATCH();
+        }
+        CASE(OP_CLOSE_UPVALUE):
+            closeUpvalues(stackTop - 1);
+            DROP();
+            DISPATCH();
+        CASE(OP_RETURN): {
+            //                printValue(pop());
+            //                printf("\n");
+            // Exit interpreter
 //                return INTERPRET_OK;
-                Value result = pop();
-                closeUpvalues(frame->slots);
-                vm.frameCount--;
-                if (vm.frameCount == 0) {
-                    pop();
-                    return INTERPRET_OK;
-                }
+            Value result = POP();
+            closeUpvalues(slots);
+            vm.frameCount--;
+            if (vm.frameCount == 0) {
+                vm.stackTop = stackTop - 1;
+                return INTERPRET_OK;
+            }
 
-                vm.stackTop = frame->slots;
-                push(result);
-                frame = &vm.frames[vm.frameCount - 1];
-                break;
+            vm.stackTop = slots;
+            push(result);
+            LOAD_FRAME();
+            SAFE_POINT();
+            DISPATCH();
+        }
+        CASE(OP_CLASS_LONG):
+            name = READ_STRING_LONG();
+            goto classOp;
+        CASE(OP_CLASS):
+            name = READ_STRING();
+        classOp:
+            SAVE_FRAME();
+            PUSH(OBJ_VAL(newClass(name)));
+            DISPATCH();
+        CASE(OP_INHERIT): {
+            Value superclass = PEEK(1);
+            if (!IS_CLASS(superclass)) {
+                RUNTIME_ERROR("Superclass must be a class.");
             }
-            case OP_CLASS:
-                push(OBJ_VAL(newClass(READ_STRING())));
-                break;
-            case OP_INHERIT: {
-                Value superclass = peek(1);
-                if (!IS_CLASS(superclass)) {
-                    runtimeError("Superclass must be a class.");
-                    return INTERPRET_RUNTIME_ERROR;
+
+            ObjClass *subclass = AS_CLASS(PEEK(0));
+            SAVE_FRAME();
+            tableAddAll(&AS_CLASS(superclass)->methods,
+                        &subclass->methods);
+            writeBarrierAll((Obj *) subclass);
+            DROP();// Subclass.
+            DISPATCH();
+        }
+        CASE(OP_METHOD_LONG):
+            name = READ_STRING_LONG();
+            goto methodOp;
+        CASE(OP_METHOD):
+            name = READ_STRING();
+        methodOp:
+            SAVE_FRAME();
+            defineMethod(name);
+            stackTop = vm.stackTop;
+            DISPATCH();
+
+        /*
+         * Superinstructions. `ip` is left on the first operand of the fused
+         * sequence, so ip[n] is byte n + 1 of the original code. When the fast
+         * path doesn't apply, a handler does only the leading GET_LOCAL and
+         * steps to the second instruction, which then runs as usual.
+         */
+        CASE(OP_ADD_LOCALS): {
+            Value a = slots[ip[0]];
+            Value b = slots[ip[2]];
+            if (IS_NUMBER(a) && IS_NUMBER(b)) {
+                PUSH(NUMBER_VAL(AS_NUMBER(a) + AS_NUMBER(b)));
+                ip += 4;
+            } else {
+                PUSH(a);
+                ip += 1;
+            }
+            DISPATCH();
+        }
+        CASE(OP_ADD_LOCAL_CONSTANT): {
+            Value a = slots[ip[0]];
+            if (IS_NUMBER(a)) {
+                double b = AS_NUMBER(constants[ip[2]]);
+                PUSH(NUMBER_VAL(AS_NUMBER(a) + b));
+                ip += 4;
+            } else {
+                PUSH(a);
+                ip += 1;
+            }
+            DISPATCH();
+        }
+        CASE(OP_LESS_LOCAL_CONSTANT_JUMP):
+            COMPARE_LOCAL_CONSTANT_JUMP(<);
+            DISPATCH();
+        CASE(OP_GREATER_LOCAL_CONSTANT_JUMP):
+            COMPARE_LOCAL_CONSTANT_JUMP(>);
+            DISPATCH();
+        CASE(OP_GET_LOCAL_PROPERTY): {
+            Value receiver = slots[ip[0]];
+            if (IS_INSTANCE(receiver)) {
+                ObjInstance *instance = AS_INSTANCE(receiver);
+                cache = &frame->closure->function->chunk
+                        .caches[(ip[3] << 8) | ip[4]];
+                CacheWay *way = findCacheWay(cache, instance->shape);
+                if (way != NULL && way->target == NULL) {
+                    PUSH(instance->fields[way->index]);
+                    ip += 5;
+                    DISPATCH();
                 }
+            }
+            PUSH(receiver);
+            ip += 1;
+            DISPATCH();
+        }
+        CASE(OP_SET_LOCAL_POP):
+            slots[ip[0]] = POP();
+            ip += 2;
+            DISPATCH();
+
+        // Register instructions: dest = a op b, all operands frame slots
+        // except the constant b of the _RK forms.
+        CASE(OP_ADD_RR):
+            REGISTER_ADD(slots[READ_BYTE()]);
+            DISPATCH();
+        CASE(OP_SUBTRACT_RR):
+            REGISTER_OP(-, slots[READ_BYTE()]);
+            DISPATCH();
+        CASE(OP_MULTIPLY_RR):
+            REGISTER_OP(*, slots[READ_BYTE()]);
+            DISPATCH();
+        CASE(OP_DIVIDE_RR):
+            REGISTER_OP(/, slots[READ_BYTE()]);
+            DISPATCH();
+        CASE(OP_ADD_RK):
+            REGISTER_ADD(READ_CONSTANT());
+            DISPATCH();
+        CASE(OP_SUBTRACT_RK):
+            REGISTER_OP(-, READ_CONSTANT());
+            DISPATCH();
+        CASE(OP_MULTIPLY_RK):
+            REGISTER_OP(*, READ_CONSTANT());
+            DISPATCH();
+        CASE(OP_DIVIDE_RK):
+            REGISTER_OP(/, READ_CONSTANT());
+            DISPATCH();
 
-                ObjClass *subclass = AS_CLASS(peek(0));
-                tableAddAll(&AS_CLASS(superclass)->methods,
-                            &subclass->methods);
-                pop();// Subclass.
-                break;
+        // Long forms of the instructions that don't share a handler above.
+        CASE(OP_CONSTANT_LONG):
+            PUSH(READ_CONSTANT_LONG());
+            DISPATCH();
+        CASE(OP_GET_LOCAL_LONG):
+            PUSH(slots[READ_SHORT()]);
+            DISPATCH();
+        CASE(OP_SET_LOCAL_LONG):
+            slots[READ_SHORT()] = PEEK(0);
+            DISPATCH();
+        CASE(OP_GET_GLOBAL_LONG): {
+            uint32_t slot = READ_LONG();
+            Value value = vm.globalValues.values[slot];
+            if (IS_UNDEFINED(value)) {
+                RUNTIME_ERROR("Undefined variable '%s'.", GLOBAL_NAME(slot));
+            }
+            PUSH(value);
+            DISPATCH();
+        }
+        CASE(OP_DEFINE_GLOBAL_LONG):
+            vm.globalValues.values[READ_LONG()] = POP();
+            DISPATCH();
+        CASE(OP_SET_GLOBAL_LONG): {
+            uint32_t slot = READ_LONG();
+            if (IS_UNDEFINED(vm.globalValues.values[slot])) {
+                RUNTIME_ERROR("Undefined variable '%s'.", GLOBAL_NAME(slot));
             }
-            case OP_METHOD:
-                defineMethod(READ_STRING());
-                break;
+            vm.globalValues.values[slot] = PEEK(0);
+            DISPATCH();
+        }
+        CASE(OP_GET_UPVALUE_LONG):
+            PUSH(*frame->closure->upvalues[READ_SHORT()]->location);
+            DISPATCH();
+        CASE(OP_SET_UPVALUE_LONG): {
+            ObjUpvalue *upvalue = frame->closure->upvalues[READ_SHORT()];
+            *upvalue->location = PEEK(0);
+            writeBarrier((Obj *) upvalue, PEEK(0));
+            DISPATCH();
+        }
+        CASE(OP_JUMP_LONG): {
+            uint32_t offset = READ_LONG();
+            ip += offset;
+            DISPATCH();
+        }
+        CASE(OP_JUMP_IF_FALSE_LONG): {
+            uint32_t offset = READ_LONG();
+            if (isFalsey(PEEK(0))) ip += offset;
+            DISPATCH();
+        }
+        CASE(OP_LOOP_LONG): {
+            uint32_t offset = READ_LONG();
+            ip -= offset;
+            SAFE_POINT();
+            DISPATCH();
         }
     }
 #undef READ_BYTE
 #undef READ_SHORT
+#undef READ_LONG
 #undef READ_CONSTANT
+#undef READ_CONSTANT_LONG
 #undef READ_STRING
+#undef READ_STRING_LONG
+#undef READ_CACHE
+#undef READ_CACHE_LONG
+#undef GLOBAL_NAME
+#undef COMPARE_LOCAL_CONSTANT_JUMP
+#undef REGISTER_OP
+#undef REGISTER_ADD
+#undef PUSH
+#undef POP
+#undef DROP
+#undef PEEK
+#undef RUNTIME_ERROR
+#undef SAVE_FRAME
+#undef LOAD_FRAME
+#undef SAFE_POINT
 #undef BINARY_OP
+#undef TRACE_INSTRUCTION
+#undef CASE
+#undef DISPATCH
+#undef INTERPRET_LOOP
     /*
          * Undefining these macros explicitly might seem needlessly fastidious, but C
          * tends to punish sloppy users, and the C preprocessor doubly so.
@@ -675,8 +1389,21 @@ InterpretResult interpret(const char *source) {
 //
 //    vm.chunk = &chunk;
 //    vm.ip = vm.chunk->code;
+    // reallocate() jumps back here when the heap is full.
+    jmp_buf outOfMemory;
+    if (setjmp(outOfMemory) != 0) {
+        vm.errorJump = NULL;
+        abandonCompile();
+        runtimeError("Out of memory.");
+        return INTERPRET_RUNTIME_ERROR;
+    }
+    vm.errorJump = &outOfMemory;
+
     ObjFunction* function = compile(source);
-    if (function == NULL) return INTERPRET_COMPILE_ERROR;
+    if (function == NULL) {
+        vm.errorJump = NULL;
+        return INTERPRET_COMPILE_ERROR;
+    }
 
     push(OBJ_VAL(function));
 
@@ -695,5 +1422,7 @@ InterpretResult interpret(const char *source) {
 //
 //    freeChunk(&chunk);
 //    return result;
-    return run();
+    InterpretResult result = run();
+    vm.errorJump = NULL;
+    return result;
 }
\ No newline at end of file
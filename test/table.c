@@ -0,0 +1,198 @@
+//
+// Created by aucker on 10/17/2026.
+//
+
+/*
+ * Runs random sets, gets and deletes on a Table and checks each result
+ * against a plain array of which keys should be in it. It checks the
+ * control bytes too, after every step while the table is small: one per
+ * entry and tombstone, and the copy after the end matching the start. Built once as is and once with
+ * TABLE_SCALAR, which takes the group matching off SSE2.
+ *
+ * The table code is included whole, so the test can see its control
+ * bytes, and gets a malloc-backed reallocate() instead of the GC heap.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#ifdef TABLE_SCALAR
+#undef __SSE2__
+#endif
+#include "../src/table.c"
+
+#include "hash.h"
+
+VM vm;
+
+void* reallocate(void* pointer, size_t oldSize, size_t newSize) {
+    if (newSize == 0) {
+        free(pointer);
+        return NULL;
+    }
+    void* result = realloc(pointer, newSize);
+    if (result == NULL) exit(1);
+    return result;
+}
+
+void markObject(Obj* object) {}
+void markValue(Value value) {}
+
+typedef enum {
+    KEYS_HASHED,
+    // Only a few distinct hashes, so probes run long.
+    KEYS_CLUSTERED,
+    // All with the same control byte, so every slot in a group matches.
+    KEYS_SAME_TAG,
+} KeyKind;
+
+static uint64_t state = 88172645463325252ull;
+
+static uint32_t randomNumber() {
+    state ^= state << 13;
+    state ^= state >> 7;
+    state ^= state << 17;
+    return (uint32_t)(state >> 32);
+}
+
+static ObjString* newKey(int i, KeyKind kind) {
+    char chars[16];
+    int length = sprintf(chars, "k%d", i);
+    ObjString* key = malloc(STRING_HEADER_SIZE + length + 1);
+    key->length = length;
+    key->chars = key->inlineChars;
+    memcpy(key->chars, chars, length + 1);
+    key->left = key->right = NULL;
+    key->isInterned = true;
+
+    uint32_t hash = hashString(chars, length);
+    switch (kind) {
+        case KEYS_HASHED: break;
+        case KEYS_CLUSTERED: hash &= 0x37f; break;
+        case KEYS_SAME_TAG: hash = (hash & ~0x7fu) | 5; break;
+    }
+    key->hash = hash;
+    return key;
+}
+
+static bool fail(const char* message, int round, long step) {
+    printf("round %d, step %ld: %s\n", round, step, message);
+    return false;
+}
+
+static bool checkControl(Table* table, int round, long step) {
+    if (table->capacity == 0) return true;
+
+    uint8_t* control = controlBytes(table->entries, table->capacity);
+    int full = 0, deleted = 0;
+    for (int i = 0; i < table->capacity; i++) {
+        if (control[i] == CONTROL_DELETED) {
+            deleted++;
+        } else if (control[i] != CONTROL_EMPTY) {
+            full++;
+            if (table->entries[i].key == NULL ||
+                control[i] != HASH_TAG(table->entries[i].key->hash)) {
+                return fail("control byte doesn't match entry", round, step);
+            }
+        }
+    }
+    for (int i = 0; i < TABLE_GROUP_WIDTH; i++) {
+        if (control[table->capacity + i] !=
+            control[i & (table->capacity - 1)]) {
+            return fail("copied control bytes out of step", round, step);
+        }
+    }
+    if (full != table->count) return fail("wrong count", round, step);
+    if (deleted != table->tombstones) {
+        return fail("wrong tombstone count", round, step);
+    }
+    if (table->count + table->tombstones > MAX_LOAD(table->capacity)) {
+        return fail("table over its maximum load", round, step);
+    }
+    return true;
+}
+
+static bool runRound(int round, int keyCount, KeyKind kind, long steps,
+                     int* smallestCapacity) {
+    ObjString** keys = malloc(sizeof(ObjString*) * keyCount);
+    bool* present = calloc(keyCount, sizeof(bool));
+    double* values = calloc(keyCount, sizeof(double));
+    for (int i = 0; i < keyCount; i++) keys[i] = newKey(i, kind);
+
+    Table table;
+    initTable(&table);
+    int live = 0;
+    bool ok = true;
+    for (long step = 0; step < steps && ok; step++) {
+        int i = (int)(randomNumber() % keyCount);
+        int action = (int)(randomNumber() % 10);
+        Value value;
+
+        if (action < 4) {
+            bool isNew = tableSet(&table, keys[i], NUMBER_VAL(step));
+            if (isNew == present[i]) ok = fail("set got it wrong", round, step);
+            if (!present[i]) live++;
+            present[i] = true;
+            values[i] = (double)step;
+        } else if (action < 7) {
+            bool deleted = tableDelete(&table, keys[i]);
+            if (deleted != present[i]) {
+                ok = fail("delete got it wrong", round, step);
+            }
+            if (present[i]) live--;
+            present[i] = false;
+        } else if (action < 9) {
+            bool found = tableGet(&table, keys[i], &value);
+            if (found != present[i] ||
+                (found && AS_NUMBER(value) != values[i])) {
+                ok = fail("get got it wrong", round, step);
+            }
+        } else {
+            ObjString* found = tableFindString(&table, keys[i]->chars,
+                                               keys[i]->length,
+                                               keys[i]->hash);
+            if (found != (present[i] ? keys[i] : NULL)) {
+                ok = fail("tableFindString() got it wrong", round, step);
+            }
+        }
+
+        if (ok && table.count != live) ok = fail("wrong count", round, step);
+        // Checking a big table's every byte each step would take minutes.
+        if (ok && (table.capacity <= 128 || step % 256 == 0)) {
+            ok = checkControl(&table, round, step);
+        }
+        if (table.capacity != 0 && table.capacity < *smallestCapacity) {
+            *smallestCapacity = table.capacity;
+        }
+    }
+
+    freeTable(&table);
+    for (int i = 0; i < keyCount; i++) free(keys[i]);
+    free(keys);
+    free(present);
+    free(values);
+    return ok;
+}
+
+int main() {
+    // Few enough keys that the table stays smaller than one group.
+    int keyCounts[] = {6, 12, 220, 5000};
+    KeyKind kinds[] = {KEYS_HASHED, KEYS_CLUSTERED, KEYS_SAME_TAG};
+    int smallestCapacity = INT32_MAX;
+
+    int round = 0;
+    for (int i = 0; i < 4; i++) {
+        for (int j = 0; j < 3; j++) {
+            if (!runRound(round++, keyCounts[i], kinds[j], 100000,
+                          &smallestCapacity)) {
+                return 1;
+            }
+        }
+    }
+
+    if (smallestCapacity >= TABLE_GROUP_WIDTH) {
+        printf("No table was smaller than a group.\n");
+        return 1;
+    }
+    return 0;
+}